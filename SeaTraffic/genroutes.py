@@ -0,0 +1,217 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# Generate synthetic routes.txt files for testing how the plugin scales with the amount of route data.
+#
+# Routes are either harbour routes - short ferry crossings clustered around a number of harbours - or ocean lanes -
+# long routes between two harbours, following the great circle.
+#
+# Usage:
+#   genroutes.py [options] [-o routes.txt]
+#       Write one routes.txt
+#   genroutes.py [options] --sweep 1,10,100
+#       Write routes-x1.txt, routes-x10.txt, routes-x100.txt with --routes scaled by each factor
+#   genroutes.py --report Log-x1.txt Log-x10.txt ...
+#       Tabulate the plugin's load time, memory use and recalc time from the Log.txt of X-Plane sessions run with each
+#       file installed as routes.txt (use Plugins->SeaTraffic->Save frame timings before quitting to get recalc times)
+#
+
+from __future__ import print_function
+
+import io
+import re
+from math import asin, atan2, cos, degrees, pi, radians, sin, sqrt
+from optparse import OptionParser
+from random import Random
+from sys import exit
+
+radius=6378145	# from sim/physics/earth_radius_m
+
+kinds=['leisure', 'tourist', 'cruise', 'ped/sml', 'ped/med', 'veh/sml', 'veh/med', 'veh/big', 'cargo', 'tanker']
+harbourkinds='leisure=2,tourist=2,ped/sml=4,ped/med=2,veh/sml=3,veh/med=3,veh/big=1'
+lanekinds='cruise=1,veh/big=2,cargo=4,tanker=2'
+
+MAXLAT=75		# keep away from the poles, like real routes
+HARBOUR_RADIUS=20000	# harbour routes start within this distance of their harbour [m]
+HARBOUR_LENGTH=(500, 20000)	# range of harbour route lengths [m]
+
+
+def parsemix(mix):
+    # "kind=weight,..." -> [(kind, cumulative weight)]
+    result=[]
+    total=0
+    for item in mix.split(','):
+        kind,weight=item.split('=')
+        if kind not in kinds:
+            raise ValueError('Unknown ship kind "%s"' % kind)
+        total+=float(weight)
+        result.append((kind, total))
+    return result
+
+def choosekind(rng, mix):
+    x=rng.uniform(0, mix[-1][1])
+    for kind,total in mix:
+        if x<=total: return kind
+    return mix[-1][0]
+
+
+def wraplon(lon):
+    # Longitude wrapped to [-180,180) [degrees]
+    return (lon+180) % 360 - 180
+
+def displaced(lat, lon, h, d):
+    # Location distance d [m] along heading h [radians] from lat,lon [degrees]
+    lat1=radians(lat)
+    lon1=radians(lon)
+    dang=float(d)/radius
+    lat2=asin(sin(lat1)*cos(dang) + cos(lat1)*sin(dang)*cos(h))
+    lon2=lon1 + atan2(sin(h)*sin(dang)*cos(lat1), cos(dang)-sin(lat1)*sin(lat2))
+    return (degrees(lat2), wraplon(degrees(lon2)))
+
+def interpolate(a, b, f):
+    # Point fraction f along the great circle from a to b [degrees]
+    lat1,lon1=radians(a[0]),radians(a[1])
+    lat2,lon2=radians(b[0]),radians(b[1])
+    d=2*asin(sqrt(sin((lat2-lat1)/2)**2 + cos(lat1)*cos(lat2)*sin((lon2-lon1)/2)**2))
+    if d==0: return a
+    p=sin((1-f)*d)/sin(d)
+    q=sin(f*d)/sin(d)
+    x=p*cos(lat1)*cos(lon1) + q*cos(lat2)*cos(lon2)
+    y=p*cos(lat1)*sin(lon1) + q*cos(lat2)*sin(lon2)
+    z=p*sin(lat1) + q*sin(lat2)
+    return (degrees(atan2(z, sqrt(x*x+y*y))), degrees(atan2(y, x)))
+
+
+def harbourroute(rng, harbour, points):
+    # A wandering route that starts near a harbour
+    lat,lon=displaced(harbour[0], harbour[1], rng.uniform(-pi, pi), rng.uniform(0, HARBOUR_RADIUS))
+    h=rng.uniform(-pi, pi)
+    step=rng.uniform(*HARBOUR_LENGTH)/max(points-1, 1)
+    path=[(lat,lon)]
+    for i in range(points-1):
+        h+=rng.gauss(0, 0.3)
+        lat,lon=displaced(lat, lon, h, step)
+        path.append((max(-MAXLAT, min(MAXLAT, lat)), lon))
+    return path
+
+def laneroute(rng, a, b, points):
+    # A great circle route between two harbours, with some jitter on the intermediate points
+    path=[a]
+    for i in range(1, points-1):
+        lat,lon=interpolate(a, b, float(i)/(points-1))
+        path.append((max(-MAXLAT, min(MAXLAT, lat+rng.gauss(0, 0.05))), wraplon(lon+rng.gauss(0, 0.05))))
+    path.append(b)
+    return path
+
+
+def generate(filename, options):
+    rng=Random(options.seed)
+    harbourmix=parsemix(options.harbourkinds)
+    lanemix=parsemix(options.lanekinds)
+    harbours=[(rng.uniform(-MAXLAT+1, MAXLAT-1), rng.uniform(-180, 180)) for i in range(options.harbours)]
+    nodes=0
+
+    h=io.open(filename, 'w', encoding='utf-8', newline='\n')
+    h.write(u'\uFEFF# Synthetic routes generated by genroutes.py: %d routes, seed %d\n\n' % (options.routes, options.seed))	# start with BOM like buildroutes.py
+    for i in range(options.routes):
+        points=max(2, int(rng.expovariate(1.0/options.points)+0.5))
+        if rng.random() < options.lanes:
+            a,b=rng.sample(harbours, 2) if len(harbours)>1 else (harbours[0], (rng.uniform(-MAXLAT, MAXLAT), rng.uniform(-180, 180)))
+            kind=choosekind(rng, lanemix)
+            path=laneroute(rng, a, b, points)
+            name=u'Lane %d' % i
+        else:
+            # Harbour sizes follow a power law so that a few are very dense
+            harbour=harbours[min(int(rng.paretovariate(1.2))-1, len(harbours)-1)]
+            kind=choosekind(rng, harbourmix)
+            path=harbourroute(rng, harbour, points)
+            name=u'Harbour route %d' % i
+        h.write(u'%s\t%s\n' % (kind, name))
+        for lat,lon in path:
+            h.write(u'%11.7f %12.7f\n' % (lat, wraplon(round(lon, 7))))	# so that rounding can't give 180
+        h.write(u'\n')
+        nodes+=len(path)
+    h.close()
+    print('%s: %d routes, %d nodes' % (filename, options.routes, nodes))
+
+
+def report(filenames, plot):
+    # Pull the plugin's summaries out of each Log.txt
+    rows=[]
+    for filename in filenames:
+        row={ 'file': filename, 'routes': None, 'load_ms': None, 'memory': None, 'recalc_p50': None, 'recalc_p99': None, 'recalc_max': None }
+        for line in io.open(filename, encoding='utf-8', errors='replace'):
+            m=re.match(r'SeaTraffic: Read (\d+) routes from routes.txt in (\d+)ms', line)
+            if m:
+                row['routes']=int(m.group(1))
+                row['load_ms']=int(m.group(2))
+            m=re.match(r'SeaTraffic: Memory: total\s+(\d+) bytes', line)
+            if m and row['memory'] is None:	# first summary is taken just after loading
+                row['memory']=int(m.group(1))
+            m=re.match(r'SeaTraffic: recalc\s+\d+ frames, 50% <\s*(\d+)us, 99% <\s*(\d+)us, 99.9% <\s*\d+us, worst <\s*(\d+)us', line)
+            if m:
+                row['recalc_p50'],row['recalc_p99'],row['recalc_max']=[int(x) for x in m.groups()]
+        rows.append(row)
+    rows.sort(key=lambda row: row['routes'] or 0)
+
+    columns=['routes', 'load_ms', 'memory', 'recalc_p50', 'recalc_p99', 'recalc_max', 'file']
+    print(','.join(columns))
+    for row in rows:
+        print(','.join(['' if row[c] is None else str(row[c]) for c in columns]))
+
+    if plot:
+        try:
+            import matplotlib
+            matplotlib.use('Agg')
+            import matplotlib.pyplot as plt
+        except ImportError:
+            print('matplotlib is needed to plot')
+            exit(1)
+        rows=[row for row in rows if row['routes']]
+        x=[row['routes'] for row in rows]
+        fig,axes=plt.subplots(3, 1, sharex=True, figsize=(6, 9))
+        axes[0].plot(x, [row['load_ms'] for row in rows], 'o-')
+        axes[0].set_ylabel('load time [ms]')
+        axes[1].plot(x, [(row['memory'] or 0)/1048576.0 for row in rows], 'o-')
+        axes[1].set_ylabel('memory [MB]')
+        axes[2].plot(x, [row['recalc_p50'] for row in rows], 'o-', label='median')
+        axes[2].plot(x, [row['recalc_p99'] for row in rows], 'o-', label='99%')
+        axes[2].set_ylabel('recalc [us]')
+        axes[2].set_xlabel('routes')
+        axes[2].legend()
+        for ax in axes:
+            ax.set_xscale('log')
+            ax.set_yscale('log')
+        fig.savefig(plot)
+        print('Wrote %s' % plot)
+
+
+# main #################################################################
+
+parser=OptionParser(usage='%prog [options]')
+parser.add_option('-o', dest='output', default='routes.txt', help='output file [%default]')
+parser.add_option('--routes', type='int', default=5000, help='number of routes [%default]')
+parser.add_option('--points', type='float', default=12, help='mean points per route [%default]')
+parser.add_option('--harbours', type='int', default=500, help='number of harbours that routes cluster around [%default]')
+parser.add_option('--lanes', type='float', default=0.1, help='proportion of routes that are ocean lanes between harbours [%default]')
+parser.add_option('--harbour-kinds', dest='harbourkinds', default=harbourkinds, help='relative weights of ship kinds on harbour routes [%default]')
+parser.add_option('--lane-kinds', dest='lanekinds', default=lanekinds, help='relative weights of ship kinds on ocean lanes [%default]')
+parser.add_option('--seed', type='int', default=1, help='random seed [%default]')
+parser.add_option('--sweep', help='comma-separated multiples of --routes; writes routes-x<multiple>.txt for each')
+parser.add_option('--report', action='store_true', help='tabulate results from the Log.txt files given as arguments')
+parser.add_option('--plot', help='with --report, also plot the results to this image file (needs matplotlib)')
+(options, args)=parser.parse_args()
+
+try:
+    if options.report:
+        if not args: parser.error('--report needs Log.txt files')
+        report(args, options.plot)
+    elif options.sweep:
+        base=options.routes
+        for multiple in options.sweep.split(','):
+            options.routes=int(base*float(multiple))
+            generate('routes-x%s.txt' % multiple, options)
+    else:
+        generate(options.output, options)
+except ValueError as e:
+    parser.error(str(e))
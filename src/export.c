@@ -0,0 +1,114 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ */
+
+#include "seatraffic.h"
+#include "export.h"
+
+/* Export of live ship state to POSIX shared memory for external tools. See export.h for the layout. Not on Windows. */
+
+#if IBM
+
+int export_start(void) { return 0; }
+void export_frame(active_route_t *active_routes, float now) { }
+void export_stop(void) { }
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static export_header_t *header = NULL;
+static size_t export_size;
+static unsigned int frame_n;
+
+
+/* Create the shared memory object. Returns 0 on failure. */
+int export_start(void)
+{
+    int fd, i;
+
+    if (header) { return -1; }
+    export_size = EXPORT_SIZE(ACTIVE_MAX);
+    if ((fd = shm_open(EXPORT_NAME, O_CREAT|O_RDWR, 0644)) < 0)
+    {
+        XPLMDebugString("SeaTraffic: Can't create shared memory " EXPORT_NAME "\n");
+        return 0;
+    }
+    if (ftruncate(fd, export_size) || (header = mmap(NULL, export_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        XPLMDebugString("SeaTraffic: Can't map shared memory " EXPORT_NAME "\n");
+        close(fd);
+        shm_unlink(EXPORT_NAME);
+        header = NULL;
+        return 0;
+    }
+    close(fd);		/* mapping stays valid */
+
+    memset(header, 0, export_size);
+    header->version = EXPORT_VERSION;
+    header->header_size = sizeof(export_header_t);
+    header->frame_size = sizeof(export_frame_t);
+    header->ship_size = sizeof(export_ship_t);
+    header->capacity = ACTIVE_MAX;
+    header->slots = EXPORT_SLOTS;
+    header->latest = 0;
+    for (i=0; i<EXPORT_SLOTS; i++)
+        EXPORT_FRAME(header, i)->seq = 0;
+    __sync_synchronize();
+    memcpy(header->magic, EXPORT_MAGIC, sizeof(header->magic));	/* Readers can start now */
+    frame_n = 0;
+    return -1;
+}
+
+
+/* Publish the current state of the active routes. No allocation. */
+void export_frame(active_route_t *active_routes, float now)
+{
+    export_frame_t *frame;
+    export_ship_t *ship;
+    unsigned int slot, n = 0;
+    active_route_t *a;
+
+    if (!header) { return; }
+
+    slot = (header->latest + 1) % EXPORT_SLOTS;
+    frame = EXPORT_FRAME(header, slot);
+    ship = EXPORT_SHIPS(header, frame);
+    frame->seq++;			/* odd - writing */
+    __sync_synchronize();
+
+    for (a=active_routes; a && n<ACTIVE_MAX; a=a->next, n++, ship++)
+    {
+        ship->id = a->id;
+        ship->kind = a->route->ship_kind;
+        ship->lat = a->loc.lat;
+        ship->lon = a->loc.lon;
+        ship->alt = (float) a->altmsl;
+        ship->heading = a->drawinfo.heading;
+        ship->speed = (a->last_node+a->direction < 0 || a->last_node+a->direction >= a->route->pathlen) ? 0 : (float) a->ship->speed;
+    }
+    frame->frame = ++frame_n;
+    frame->sim_time = now;
+    frame->ship_n = n;
+
+    __sync_synchronize();
+    frame->seq++;			/* even - done */
+    header->latest = slot;
+}
+
+
+/* Remove the shared memory object. Readers that still have it mapped keep the last frame. */
+void export_stop(void)
+{
+    if (!header) { return; }
+    munmap(header, export_size);
+    shm_unlink(EXPORT_NAME);
+    header = NULL;
+}
+
+#endif	/* IBM */
@@ -0,0 +1,64 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Layout of the live ship state that the plugin publishes in POSIX shared memory, for external tools.
+ * This file is self-contained so that it can be included by readers - see stexport.c for an example.
+ *
+ * The shared memory object EXPORT_NAME holds an export_header_t followed by EXPORT_SLOTS frames, each of which is an
+ * export_frame_t followed by "capacity" export_ship_t records. The plugin writes each sim frame into the next slot
+ * in turn and then points "latest" at it. Each slot is protected by a seqlock: "seq" is odd while the slot is being
+ * written. To read a consistent frame:
+ *   1. i = latest; s = slot[i].seq; if s is odd, start again
+ *   2. copy slot[i]'s frame and ships
+ *   3. if slot[i].seq != s, start again
+ * All values are in the byte order of the machine running X-Plane.
+ */
+
+#ifndef SEATRAFFIC_EXPORT_H
+#define SEATRAFFIC_EXPORT_H
+
+#define EXPORT_NAME "/seatraffic"
+#define EXPORT_MAGIC "STSX"
+#define EXPORT_VERSION 1
+#define EXPORT_SLOTS 4
+
+typedef struct
+{
+    char magic[4];		/* EXPORT_MAGIC */
+    unsigned int version;	/* EXPORT_VERSION */
+    unsigned int header_size;	/* sizeof(export_header_t) */
+    unsigned int frame_size;	/* sizeof(export_frame_t) */
+    unsigned int ship_size;	/* sizeof(export_ship_t) */
+    unsigned int capacity;	/* Maximum number of ships in each frame */
+    unsigned int slots;		/* EXPORT_SLOTS */
+    volatile unsigned int latest;	/* Index of the slot most recently written */
+} export_header_t;
+
+typedef struct
+{
+    volatile unsigned int seq;	/* Seqlock - odd while being written */
+    unsigned int frame;		/* Increments with each frame written */
+    double sim_time;		/* sim/time/total_running_time_sec [s] */
+    unsigned int ship_n;	/* Number of valid ships */
+    unsigned int pad;
+} export_frame_t;
+
+typedef struct
+{
+    unsigned int id;		/* Unique for the life of a ship */
+    unsigned int kind;		/* 0=leisure, tourist, cruise, ped/sml, ped/med, veh/sml, veh/med, veh/big, cargo, 9=tanker */
+    double lat, lon;		/* [degrees] - may lag by a few frames for ships far from the viewer */
+    float alt;			/* MSL [m] */
+    float heading;		/* True [degrees] */
+    float speed;		/* [m/s] - 0 while docked */
+    float pad;
+} export_ship_t;
+
+/* Address of a slot's frame, and its ships */
+#define EXPORT_FRAME(header, i) ((export_frame_t *) ((char *) (header) + (header)->header_size + (i) * ((header)->frame_size + (header)->capacity * (header)->ship_size)))
+#define EXPORT_SHIPS(header, frame) ((export_ship_t *) ((char *) (frame) + (header)->frame_size))
+#define EXPORT_SIZE(capacity) (sizeof(export_header_t) + EXPORT_SLOTS * (sizeof(export_frame_t) + (capacity) * sizeof(export_ship_t)))
+
+#endif	/* SEATRAFFIC_EXPORT_H */
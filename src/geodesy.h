@@ -0,0 +1,92 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Great circle calculations on a spherical earth, used to move ships along their routes.
+ * This file is self-contained so that the standalone benchmark stgeodesy.c can build exactly the same code.
+ */
+
+#ifndef SEATRAFFIC_GEODESY_H
+#define SEATRAFFIC_GEODESY_H
+
+#include <math.h>
+
+#define RADIUS 6378145.f	/* from sim/physics/earth_radius_m [m] */
+#define DEG_LENGTH (RADIUS*(float)(M_PI/180))	/* Length of a degree of latitude [m] */
+
+/* Geolocation, used for route paths */
+typedef struct
+{
+    float lat, lon;	/* we don't need double precision so save some memory */
+} loc_t;
+
+/* Current location */
+typedef struct
+{
+    double lat, lon;	/* we do want double precision to prevent jerkiness */
+} dloc_t;
+
+
+/* Great circle distance, using Haversine formula. http://mathforum.org/library/drmath/view/51879.html */
+static inline float distanceto(loc_t a, loc_t b)
+{
+    float slat=sinf((b.lat-a.lat) * (float) (M_PI/360));
+    float slon=sinf((b.lon-a.lon) * (float) (M_PI/360));
+    float aa=slat*slat + cosf(a.lat * (float) (M_PI/180)) * cosf(b.lat * (float) (M_PI/180)) * slon*slon;
+    return RADIUS*2 * atan2f(sqrtf(aa), sqrtf(1-aa));
+}
+
+
+/* Bearing of b from a [radians] http://mathforum.org/library/drmath/view/55417.html */
+static inline float headingto(loc_t a, loc_t b)
+{
+    float lat1=(a.lat * (float) (M_PI/180));
+    float lon1=(a.lon * (float) (M_PI/180));
+    float lat2=(b.lat * (float) (M_PI/180));
+    float lon2=(b.lon * (float) (M_PI/180));
+    float clat2=cosf(lat2);
+    return fmodf(atan2f(sinf(lon2-lon1)*clat2, cosf(lat1)*sinf(lat2)-sinf(lat1)*clat2*cosf(lon2-lon1)), (float) (M_PI*2));
+}
+
+
+/* Location distance d along heading h from a [degrees]. Assumes d < circumference/4. http://williams.best.vwh.net/avform.htm#LL */
+static inline void displaced(loc_t a, double h, double d, dloc_t *b)
+{
+    double lat1=((double) a.lat * M_PI/180);
+    double lon1=((double) a.lon * M_PI/180);
+    double clat1=cos(lat1);
+    double dang=(d/(double)RADIUS);
+    double sang=sin(dang);
+    double slon=sin(h)*sang/clat1;
+    double lon2;
+    if (slon > 1) { slon=1; } else if (slon < -1) { slon=-1; }	/* Out of range for long distances at high latitudes */
+    lon2=lon1+asin(slon);
+    if (lon2 < -M_PI) { lon2 += M_PI*2; } else if (lon2 >= M_PI) { lon2 -= M_PI*2; }	/* fmod would keep the sign */
+    b->lat=asin(sin(lat1)*cos(dang)+clat1*sang*cos(h)) * (180*M_1_PI);
+    b->lon=lon2 * (180*M_1_PI);
+}
+
+
+/* Round a displaced() location to a route location, keeping its longitude in [-180,180) */
+static inline loc_t toloc(const dloc_t *d)
+{
+    loc_t loc;
+    loc.lat = (float) d->lat;
+    loc.lon = (float) d->lon;
+    if (loc.lon >= 180) { loc.lon -= 360; }	/* A longitude just short of 180 can round up */
+    return loc;
+}
+
+
+/* Point j of n equal steps along the course that a ship takes from a towards b, given headingto(a, b) and the distance.
+ * On long segments this can be a long way from the straight line in lat/lon between a and b, differs with direction
+ * since displaced() assumes a short distance, and needn't end at b - ships then jump to b. */
+static inline loc_t coursestep(loc_t a, double h, float d, int j, int n)
+{
+    dloc_t loc;
+    displaced(a, h, (double) d * j / n, &loc);
+    return toloc(&loc);
+}
+
+#endif	/* SEATRAFFIC_GEODESY_H */
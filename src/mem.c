@@ -0,0 +1,80 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ */
+
+#include "seatraffic.h"
+
+/* Memory accounting. Allocation sites report what they allocate and free, by subsystem. */
+
+static const char *kind_names[mem_kind_count] = { "paths", "names", "tiles", "candidates", "active", "models", "map" };
+static int kind_allocs[mem_kind_count], kind_bytes[mem_kind_count];
+static XPLMDataRef kind_refs[mem_kind_count][2];
+
+
+/* Account for allocations (or, if negative, frees) */
+void mem_add(mem_kind_t kind, int allocs, int bytes)
+{
+    kind_allocs[kind] += allocs;
+    kind_bytes[kind] += bytes;
+}
+
+
+void mem_stats(mem_kind_t kind, int *allocs, int *bytes)
+{
+    *allocs = kind_allocs[kind];
+    *bytes = kind_bytes[kind];
+}
+
+
+/* Write current usage to Log.txt */
+void mem_summary(void)
+{
+    int i, total=0;
+    char buf[80];
+
+    for (i=0; i<mem_kind_count; i++)
+    {
+        sprintf(buf, "SeaTraffic: Memory: %-10s %7d allocations %9d bytes\n", kind_names[i], kind_allocs[i], kind_bytes[i]);
+        XPLMDebugString(buf);
+        total += kind_bytes[i];
+    }
+    sprintf(buf, "SeaTraffic: Memory: total %9d bytes\n", total);
+    XPLMDebugString(buf);
+}
+
+
+/* Dataref accessor */
+static int getmemi(void *inRefcon)
+{
+    return *(int *) inRefcon;
+}
+
+
+/* Publish as marginal/seatraffic/mem/<kind>_allocs and _bytes */
+void mem_register(void)
+{
+    int i;
+    char name[64];
+
+    for (i=0; i<mem_kind_count; i++)
+    {
+        sprintf(name, DATAREF_PREFIX "mem/%s_allocs", kind_names[i]);
+        kind_refs[i][0] = XPLMRegisterDataAccessor(name, xplmType_Int, 0, getmemi, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, kind_allocs + i, NULL);
+        sprintf(name, DATAREF_PREFIX "mem/%s_bytes", kind_names[i]);
+        kind_refs[i][1] = XPLMRegisterDataAccessor(name, xplmType_Int, 0, getmemi, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, kind_bytes + i, NULL);
+    }
+}
+
+
+void mem_unregister(void)
+{
+    int i;
+    for (i=0; i<mem_kind_count; i++)
+    {
+        XPLMUnregisterDataAccessor(kind_refs[i][0]);
+        XPLMUnregisterDataAccessor(kind_refs[i][1]);
+    }
+}
@@ -10,6 +10,7 @@
 /* Use asynchronous object loading if on v10 */
 typedef void (* XPLMLoadObjectAsync_f) (const char *inPath, XPLMObjectLoaded_f inCallback, void *inRefcon);
 static XPLMLoadObjectAsync_f myXPLMLoadObjectAsync;
+static int async_looked = 0;
 
 static void libraryloadimmediate(const char *inFilePath, void *inRef);
 static void libraryloadasync(const char *inFilePath, void *inRef);
@@ -17,9 +18,32 @@ static void libraryloadasync(const char *inFilePath, void *inRef);
 
 /* Globals */
 
-static ship_models_t default_models[ship_kind_count] = { 0 };	/* The default set of models */
-static ship_models_t *model_cache[180][360] = { 0 };		/* Per-tile sets of models */
+static tile_models_t default_models = { 0 };			/* The default set of models */
+static tile_models_t *model_cache[180][360] = { 0 };		/* Per-tile sets of models */
 static XPLMLibraryEnumerator_f libraryloadfn;			/* fn pointer for loading objects */
+static int model_id_n = 0;					/* Next model id to hand out */
+static tile_models_t *custom_models = NULL;			/* List of sets that aren't just the default set */
+static int prefetch_n = 0, early_n = 0, late_n = 0;		/* Custom tiles prefetched, and whether they were ready in time */
+static int loaded_n = 0, evicted_n = 0;				/* Custom objects loaded and unloaded */
+static int startup_pending = 1;					/* Wakes and default models still loading, plus one until models_init() has started them all */
+static int startup_failed = 0;					/* Some kind of ship has no default model */
+static double startup_start = 0;				/* When we started loading them [us] */
+
+/* Results of library lookups, persisted between sessions */
+#define CUSTOM_KNOWN 0x8000
+static unsigned short custom_kinds[180][360] = { 0 };		/* CUSTOM_KNOWN | bitmask of customized ship kinds */
+static char cache_path[PATH_MAX] = "";
+static unsigned int cache_fingerprint;
+static int cache_dirty = 0;
+
+
+/* Context for loading objects for one kind of ship */
+typedef struct
+{
+    tile_models_t *tile_models;
+    ship_kind_t kind;
+    int obj;
+} model_load_t;
 
 
 typedef struct
@@ -66,6 +90,77 @@ XPLMObjectRef loadobject(const char *path)
 }
 
 
+/* Is asynchronous object loading available? */
+static int asyncavailable(void)
+{
+    if (!async_looked)
+    {
+        myXPLMLoadObjectAsync = XPLMFindSymbol("XPLMLoadObjectAsync");
+        async_looked = 1;
+#ifdef DEBUG
+        XPLMDebugString(myXPLMLoadObjectAsync ? "SeaTraffic: Using Async loading\n" : "SeaTraffic: Using immediate loading\n");
+#endif
+    }
+    return myXPLMLoadObjectAsync != NULL;
+}
+
+
+/* One of the wakes or default models has finished loading, or models_init() has finished starting them */
+static void startuploaded(void)
+{
+    char buf[80];
+    int i, j, k;
+
+    if (--startup_pending) return;
+
+    /* An object that failed to load leaves its slot NULL. Fill it with another model of the same kind, since ships
+     * may already be using the slot. Give up if none of a kind's models loaded. */
+    for (i=0; i<ship_kind_count; i++)
+    {
+        ship_models_t *models = default_models.models + i;
+        for (j=0; j<models->obj_n && !models->refs[j]; j++);
+        if (j >= models->obj_n)
+        {
+            XPLMDebugString("SeaTraffic: Can't load any default objects for ship \"");
+            XPLMDebugString(ships[i].token);
+            XPLMDebugString("\"\n");
+            startup_failed = 1;
+            continue;
+        }
+        for (k=0; k<models->obj_n; k++)
+            if (!models->refs[k])
+            {
+                models->refs[k] = models->refs[j];
+                models->ids[k] = models->ids[j];
+            }
+    }
+
+    sprintf(buf, "SeaTraffic: Wakes and default models ready after %.0fms\n", (perf_time() - startup_start) / 1000.0);
+    XPLMDebugString(buf);
+}
+
+
+static void objectloaded(XPLMObjectRef inObject, void *inRefcon)
+{
+    /* X-Plane puts its own message in Log.txt if the object can't be loaded */
+    *(XPLMObjectRef *) inRefcon = inObject;
+    startuploaded();
+}
+
+/* Load one of our own objects, asynchronously if possible. *ref stays NULL until the object has loaded, and must not move. */
+int loadobjectasync(const char *path, XPLMObjectRef *ref)
+{
+    if (!startup_start) { startup_start = perf_time(); }
+    if (!asyncavailable())
+        return (*ref = loadobject(path)) != NULL;
+
+    *ref = NULL;
+    startup_pending ++;
+    myXPLMLoadObjectAsync(path, objectloaded, ref);
+    return 1;
+}
+
+
 /* Callback from XPLMLookupObjects used to count objects */
 static void libraryloaddummy(const char *inFilePath, void *inRef)
 {}
@@ -77,13 +172,13 @@ static int libraryloadcommon(const char *inFilePath, ship_models_t *models)
     {
         return 0;	/* OpenSceneryX placeholder */
     }
-    else if (!(models->refs  = realloc(models->refs,  (models->obj_n + 1) * sizeof(XPLMObjectRef))) ||
-             !(models->names = realloc(models->names, (models->obj_n + 1) * sizeof(char*))))
+    else if (!(models->refs = realloc(models->refs, (models->obj_n + 1) * sizeof(XPLMObjectRef))) ||
+             !(models->ids  = realloc(models->ids,  (models->obj_n + 1) * sizeof(int))))
     {
         XPLMDebugString("SeaTraffic: Out of memory!");
         return 0;
     }
-    models->names[models->obj_n] = (char*) inFilePath;
+    models->ids[models->obj_n] = model_id_n++;
     return -1;
 }
 
@@ -91,30 +186,102 @@ static int libraryloadcommon(const char *inFilePath, ship_models_t *models)
 /* Callback from XPLMLookupObjects to load ship objects */
 static void libraryloadimmediate(const char *inFilePath, void *inRef)
 {
-    ship_models_t *models = inRef;
+    model_load_t *load = inRef;
+    ship_models_t *models = load->tile_models->models + load->kind;
     if (libraryloadcommon(inFilePath, models) &&
         (models->refs[models->obj_n] = loadobject(inFilePath)))
+    {
         models->obj_n ++;
+        mem_add(mem_models, models->obj_n==1 ? 2 : 0, sizeof(XPLMObjectRef) + sizeof(int));
+        if (load->tile_models != &default_models) { loaded_n ++; }
+    }
+}
+
+
+/* Log how long a tile's custom models took to load, and whether they were ready before a ship needed them */
+static void tileready(tile_models_t *tile_models)
+{
+    char buf[128];
+    tile_models->ready = perf_time();
+    sprintf(buf, "SeaTraffic: Models for tile %+03d,%+04d ready in %.2fs", tile_models->tile.south, tile_models->tile.west, (tile_models->ready - tile_models->requested) / 1000000.0);
+    XPLMDebugString(buf);
+    if (tile_models->needed)
+    {
+        sprintf(buf, ", %.2fs after first needed\n", (tile_models->ready - tile_models->needed) / 1000000.0);
+        late_n++;
+    }
+    else
+    {
+        strcpy(buf, " - prefetched\n");
+        early_n++;
+    }
+    XPLMDebugString(buf);
 }
 
 
 static void libraryloaded(XPLMObjectRef inObject, void *inRefcon)
 {
     /* Too late to give an error if it can't be loaded (inObject==NULL) but X-Plane's will put its own message in Log.txt */
-    XPLMObjectRef *ref = inRefcon;
-    *ref = inObject;
+    model_load_t *load = inRefcon;
+    load->tile_models->models[load->kind].refs[load->obj] = inObject;
+    if (load->tile_models == &default_models)
+        startuploaded();
+    else
+    {
+        if (inObject) { loaded_n ++; }
+        if (!--load->tile_models->pending)
+            tileready(load->tile_models);
+    }
+    free(load);
 }
 
 /* Callback from XPLMLookupObjects to load ship objects */
 static void libraryloadasync(const char *inFilePath, void *inRef)
 {
-    ship_models_t *models = inRef;
+    model_load_t *load, *context = inRef;
+    ship_models_t *models = context->tile_models->models + context->kind;
     if (libraryloadcommon(inFilePath, models))
     {
+        /* Record where the object goes by index, since models->refs may move as more objects are found */
+        if (!(load = malloc(sizeof(model_load_t))))
+        {
+            XPLMDebugString("SeaTraffic: Out of memory!");
+            return;
+        }
+        *load = *context;
+        load->obj = models->obj_n;
         models->refs[models->obj_n] = NULL;
-        myXPLMLoadObjectAsync(inFilePath, libraryloaded, &(models->refs[models->obj_n]));
         models->obj_n ++;
+        mem_add(mem_models, models->obj_n==1 ? 2 : 0, sizeof(XPLMObjectRef) + sizeof(int));
+        if (context->tile_models == &default_models)
+            startup_pending ++;
+        else
+            context->tile_models->pending ++;
+        myXPLMLoadObjectAsync(inFilePath, libraryloaded, load);
+    }
+}
+
+
+/* Which kinds of ship have custom models in the library for this tile? Answered from the persistent cache if possible. */
+static unsigned short customkinds(int south, int west)
+{
+    unsigned short *kinds = &custom_kinds[south+90][west+180];
+    if (!(*kinds & CUSTOM_KNOWN))
+    {
+        int i;
+        char name[sizeof(LIBRARY_PREFIX) + LIBRARY_TOKEN_MAX + 4] = LIBRARY_PREFIX;
+
+        *kinds = CUSTOM_KNOWN;
+        for (i=0; i<ship_kind_count; i++)
+        {
+            strcpy(name + sizeof(LIBRARY_PREFIX) - 1, ships[i].token);
+            strcat(name, ".obj");
+            if (XPLMLookupObjects(name, south, west, libraryloaddummy, NULL))
+                *kinds |= 1 << i;
+        }
+        cache_dirty = 1;
     }
+    return *kinds & ~CUSTOM_KNOWN;
 }
 
 
@@ -122,56 +289,229 @@ static void libraryloadasync(const char *inFilePath, void *inRef)
 static int hascustommodels(int south, int west, int errorme)
 {
     int i, found = 0;
-    char name[sizeof(LIBRARY_PREFIX) + LIBRARY_TOKEN_MAX + 4] = LIBRARY_PREFIX;
+    unsigned short kinds = customkinds(south, west);
+
+    if (!errorme) { return kinds ? -1 : 0; }
 
     for (i=0; i<ship_kind_count; i++)
+        if (kinds & (1 << i))
+        {
+            XPLMDebugString("SeaTraffic: Missing REGION statement for customization of ship \"" LIBRARY_PREFIX);
+            XPLMDebugString(ships[i].token);
+            XPLMDebugString(".obj\"\n");
+            found = -1;
+        }
+    return found;
+}
+
+
+/* FNV-1a hash */
+static unsigned int fnv(unsigned int hash, const void *data, size_t len)
+{
+    const unsigned char *c = data;
+    while (len--)
+        hash = (hash ^ *(c++)) * 16777619U;
+    return hash;
+}
+
+
+/* Fingerprint the folders in Custom Scenery and their library.txt files, regardless of the order they're listed in.
+ * syspath is the X-Plane system folder in posix format. */
+static unsigned int packsfingerprint(const char *syspath)
+{
+    char xplmpath[PATH_MAX], path[PATH_MAX], names[4096], *indices[64];
+    int first = 0, total, returned, done, i;
+    unsigned int hash = 0;
+
+    /* XPLMGetDirectoryContents wants X-Plane's own path format, which is HFS on X-Plane 9 on Mac */
+    XPLMGetSystemPath(xplmpath);
+    if (strlen(xplmpath) + sizeof("Custom Scenery") > sizeof(xplmpath)) { return 0; }
+    strcat(xplmpath, "Custom Scenery");
+    do
     {
-        strcpy(name + sizeof(LIBRARY_PREFIX) - 1, ships[i].token);
-        strcat(name, ".obj");
-        if (XPLMLookupObjects(name, south, west, libraryloaddummy, NULL))
+        done = XPLMGetDirectoryContents(xplmpath, first, names, sizeof(names), indices, sizeof(indices)/sizeof(indices[0]), &total, &returned);
+        for (i=0; i<returned; i++)
         {
-            if (errorme)
+            struct stat info;
+            unsigned int pack = fnv(2166136261U, indices[i], strlen(indices[i]));
+
+            if (strlen(syspath) + strlen(indices[i]) + sizeof("Custom Scenery//library.txt") <= sizeof(path))
             {
-                XPLMDebugString("SeaTraffic: Missing REGION statement for customization of ship \"");
-                XPLMDebugString(name);
-                XPLMDebugString("\"\n");
-                found = -1;
+                strcat(strcat(strcat(strcpy(path, syspath), "Custom Scenery/"), indices[i]), "/library.txt");
+                if (!stat(path, &info))
+                {
+                    pack = fnv(pack, &info.st_mtime, sizeof(info.st_mtime));
+                    pack = fnv(pack, &info.st_size, sizeof(info.st_size));
+                }
             }
-            else
+            hash += pack;
+        }
+        first += returned;
+    } while (!done && returned);
+    return hash;
+}
+
+
+/* Fingerprint the X-Plane version and the installed scenery packs' library.txt files,
+ * so that we can tell whether the cached results of library lookups are still valid.
+ * X-Plane 9 has no scenery_packs.ini, in which case we look at what's in the Custom Scenery folder instead. */
+static unsigned int libraryfingerprint(void)
+{
+    char syspath[PATH_MAX], path[PATH_MAX], line[PATH_MAX];
+    int xplane_ver, xplm_ver;
+    XPLMHostApplicationID host_id;
+    unsigned int hash = 2166136261U;
+    FILE *h;
+
+    XPLMGetVersions(&xplane_ver, &xplm_ver, &host_id);
+    hash = fnv(hash, &xplane_ver, sizeof(xplane_ver));
+
+    XPLMGetSystemPath(syspath);
+    posixify(syspath);
+    strcpy(path, syspath);
+    strcat(path, "Custom Scenery/scenery_packs.ini");
+    if (!(h = fopen(path, "r")))
+    {
+        unsigned int packs = packsfingerprint(syspath);
+        return fnv(hash, &packs, sizeof(packs));
+    }
+    while (fgets(line, sizeof(line), h))
+    {
+        struct stat info;
+        char *c;
+
+        hash = fnv(hash, line, strlen(line));
+        if (strncmp(line, "SCENERY_PACK ", 13)) { continue; }	/* Not an enabled pack */
+
+        c = line + strlen(line) - 1;
+        while ((c >= line) && isspace(*c)) { *(c--) = 0; }	/* rtrim */
+        c = line + 13;
+        if (strlen(syspath) + strlen(c) + sizeof("/library.txt") > sizeof(path)) { continue; }
+        if (*c == '/' || (*c && c[1] == ':'))
+            strcpy(path, c);		/* absolute */
+        else
+            strcat(strcpy(path, syspath), c);
+        if (path[strlen(path)-1] != '/') { strcat(path, "/"); }
+        strcat(path, "library.txt");
+        if (!stat(path, &info))
+        {
+            hash = fnv(hash, &info.st_mtime, sizeof(info.st_mtime));
+            hash = fnv(hash, &info.st_size, sizeof(info.st_size));
+        }
+    }
+    fclose(h);
+    return hash;
+}
+
+
+/* Read the results of previous sessions' library lookups, if the scenery library hasn't changed since */
+static void cacheload(void)
+{
+    char *c;
+    unsigned int version, fingerprint, kinds;
+    int south, west, n = 0;
+    double start = perf_time();
+    FILE *h;
+
+    XPLMGetPrefsPath(cache_path);
+    posixify(cache_path);
+    if (!(c = strrchr(cache_path, '/')))
+    {
+        *cache_path = 0;
+        return;
+    }
+    strcpy(c + 1, LIBRARY_CACHE);
+    cache_fingerprint = libraryfingerprint();
+
+    if (!(h = fopen(cache_path, "r"))) { return; }
+    if ((fscanf(h, "SeaTraffic %u %x", &version, &fingerprint) == 2) && (version == LIBRARY_CACHE_VERSION) && (fingerprint == cache_fingerprint))
+    {
+        while (fscanf(h, "%d %d %x", &south, &west, &kinds) == 3)
+            if ((south >= -90) && (south < 90) && (west >= -180) && (west < 180))
             {
-                return -1;
+                custom_kinds[south+90][west+180] = CUSTOM_KNOWN | (kinds & ((1 << ship_kind_count) - 1));
+                n++;
             }
-        }
     }
-    return found;
+    else
+    {
+        cache_dirty = 1;	/* Replace stale cache */
+    }
+    fclose(h);
+
+    if (n)
+    {
+        char buf[128];
+        sprintf(buf, "SeaTraffic: Using cached library lookups for %d tiles (%.1fms)\n", n, (perf_time() - start) / 1000.0);
+        XPLMDebugString(buf);
+    }
 }
 
 
-ship_models_t *models_for_tile(int south, int west)
+/* Save the results of library lookups for next time */
+void models_save(void)
 {
+    int south, west;
+    FILE *h;
+
+    if (!cache_dirty || !*cache_path) { return; }
+    if (!(h = fopen(cache_path, "w")))
+    {
+        XPLMDebugString("SeaTraffic: Can't write \"");
+        XPLMDebugString(cache_path);
+        XPLMDebugString("\"\n");
+        return;
+    }
+    fprintf(h, "SeaTraffic %u %08x\n", LIBRARY_CACHE_VERSION, cache_fingerprint);
+    for (south = -90; south < 90; south++)
+        for (west = -180; west < 180; west++)
+            if (custom_kinds[south+90][west+180] & CUSTOM_KNOWN)
+                fprintf(h, "%d %d %x\n", south, west, custom_kinds[south+90][west+180] & ~CUSTOM_KNOWN);
+    fclose(h);
+    cache_dirty = 0;
+}
+
+
+/* Look up, and if necessary initiate loading of, the set of models for a tile */
+static tile_models_t *tilemodels(int south, int west)
+{
+    unsigned short kinds;
+
+    if (south < -90 || south >= 90) { return &default_models; }
+    if (west < -180) { west += 360; } else if (west >= 180) { west -= 360; }
     if (!model_cache[south+90][west+180])
     {
-        model_cache[south+90][west+180] = default_models;
-        if (hascustommodels(south, west, 0))
+        model_cache[south+90][west+180] = &default_models;
+        if ((kinds = customkinds(south, west)))
         {
             /* Initiate load of custom models for this tile */
-            ship_models_t *models = calloc(ship_kind_count, sizeof(ship_models_t));
-            if (models)
+            tile_models_t *tile_models = calloc(1, sizeof(tile_models_t));
+            if (tile_models)
             {
-                int i;
+                model_load_t load = { 0 };
                 char name[sizeof(LIBRARY_PREFIX) + LIBRARY_TOKEN_MAX + 4] = LIBRARY_PREFIX;
 
-                model_cache[south+90][west+180] = models;
-                for (i=0; i<ship_kind_count; i++)
+                mem_add(mem_models, 1, sizeof(tile_models_t));
+                model_cache[south+90][west+180] = tile_models;
+                tile_models->next = custom_models;
+                custom_models = tile_models;
+                tile_models->tile.south = south;
+                tile_models->tile.west = west;
+                tile_models->requested = perf_time();
+                tile_models->pending = 1;	/* Hold off completion until all loads have been initiated */
+                load.tile_models = tile_models;
+                for (load.kind=0; load.kind<ship_kind_count; load.kind++)
                 {
-                    strcpy(name + sizeof(LIBRARY_PREFIX) - 1, ships[i].token);
+                    strcpy(name + sizeof(LIBRARY_PREFIX) - 1, ships[load.kind].token);
                     strcat(name, ".obj");
-                    if (!(XPLMLookupObjects(name, south, west, libraryloadfn, models + i)))
+                    if (!(kinds & (1 << load.kind)) || !(XPLMLookupObjects(name, south, west, libraryloadfn, &load)))
                     {
                         /* This particular kind is not customized - copy from default */
-                        memcpy(models + i, default_models + i, sizeof(ship_models_t));
+                        memcpy(tile_models->models + load.kind, default_models.models + load.kind, sizeof(ship_models_t));
                     }
                 }
+                if (!--tile_models->pending)
+                    tileready(tile_models);
             }
         }
     }
@@ -179,49 +519,150 @@ ship_models_t *models_for_tile(int south, int west)
 }
 
 
+/* Models for ships starting in a tile. These may not have finished loading.
+ * The caller must call models_release() when it no longer needs them. */
+tile_models_t *models_for_tile(int south, int west)
+{
+    tile_models_t *tile_models = tilemodels(south, west);
+    if (tile_models->pending && !tile_models->needed)
+        tile_models->needed = perf_time();
+    tile_models->users ++;
+    return tile_models;
+}
+
+
+void models_release(tile_models_t *tile_models)
+{
+    tile_models->users --;
+    assert(tile_models->users >= 0);
+}
+
+
+/* Start loading the models for a tile that ships may need soon. Returns non-zero if any work was done. */
+int models_prefetch(int south, int west)
+{
+    if (south < -90 || south >= 90) { return 0; }
+    if (west < -180) { west += 360; } else if (west >= 180) { west -= 360; }
+    if (model_cache[south+90][west+180]) { return 0; }
+    if (tilemodels(south, west) != &default_models)
+        prefetch_n++;
+    return -1;
+}
+
+
+/* Unload a custom set of models */
+static void unloadtile(tile_models_t *tile_models)
+{
+    int i, j, n = 0;
+    char buf[128];
+
+    for (i=0; i<ship_kind_count; i++)
+    {
+        ship_models_t *models = tile_models->models + i;
+        if (models->refs == default_models.models[i].refs) { continue; }	/* not customized */
+        for (j=0; j<models->obj_n; j++)
+            if (models->refs[j])
+            {
+                XPLMUnloadObject(models->refs[j]);
+                n++;
+            }
+        if (models->obj_n) { mem_add(mem_models, -2, -(int) (models->obj_n * (sizeof(XPLMObjectRef) + sizeof(int)))); }
+        free(models->refs);
+        free(models->ids);
+    }
+    evicted_n += n;
+    model_cache[tile_models->tile.south+90][tile_models->tile.west+180] = NULL;	/* Look again if we come back */
+    sprintf(buf, "SeaTraffic: Unloaded %d models for tile %+03d,%+04d\n", n, tile_models->tile.south, tile_models->tile.west);
+    XPLMDebugString(buf);
+    free(tile_models);
+    mem_add(mem_models, -1, -(int) sizeof(tile_models_t));
+}
+
+
+/* Unload custom models that have been unused and out of range for EVICT_TIME. Cheap enough to call every frame.
+ * The range is generous so as not to throw away models that models_prefetch() has just loaded. */
+void models_evict(tile_t current_tile, int range)
+{
+    double now = perf_time();
+    tile_models_t **last = &custom_models;
+
+    while (*last)
+    {
+        tile_models_t *tile_models = *last;
+        if (tile_models->users || tile_models->pending ||
+            ((abs(tile_models->tile.south - current_tile.south) <= range+1) &&
+             (abs(tile_models->tile.west  - current_tile.west)  <= range+1)))
+        {
+            tile_models->unused = 0;
+        }
+        else if (!tile_models->unused)
+        {
+            tile_models->unused = now;
+        }
+        else if (now - tile_models->unused >= (double) EVICT_TIME * 1000000.0)
+        {
+            *last = tile_models->next;
+            unloadtile(tile_models);
+            continue;
+        }
+        last = &tile_models->next;
+    }
+}
+
+
+/* Counts of custom objects loaded and unloaded */
+void models_objects(int *loaded, int *evicted)
+{
+    *loaded = loaded_n;
+    *evicted = evicted_n;
+}
+
+
+/* Counts of custom tiles prefetched, and how many of all custom tiles were ready before and after ships needed them */
+void models_stats(int *prefetched, int *early, int *late)
+{
+    *prefetched = prefetch_n;
+    *early = early_n;
+    *late = late_n;
+}
+
+
 /* Initialisation - load default models. Called after scenery library has been scanned. */
 int models_init(char *respath)
 {
     int i;
 
+    cacheload();
+
     /* First check attempt to replace models outwith a region by looking at the poles */
     if (hascustommodels(89, 179, -1) || hascustommodels(-90, -180, -1))
         return 0;
 
-    /* Load custom models asynchronously if possible */
-    myXPLMLoadObjectAsync = XPLMFindSymbol("XPLMLoadObjectAsync");
-    libraryloadfn = myXPLMLoadObjectAsync ? libraryloadasync : libraryloadimmediate;
-#ifdef DEBUG
-    XPLMDebugString(myXPLMLoadObjectAsync ? "SeaTraffic: Using Async loading\n" : "SeaTraffic: Using immediate loading\n");
-#endif
+    /* Load models asynchronously if possible */
+    libraryloadfn = asyncavailable() ? libraryloadasync : libraryloadimmediate;
 
     for (i=0; i<sizeof(default_library)/sizeof(ship_library_t); i++)
     {
         ship_kind_t kind = default_library[i].kind;
         char *name = default_library[i].name;
-        ship_models_t *models = &default_models[kind];
+        ship_models_t *models = &default_models.models[kind];
+        model_load_t load = { 0 };
+        load.tile_models = &default_models;
+        load.kind = kind;
         if (!strchr(name, '/'))
         {
             /* Local resource */
-            if (!(models->refs  = realloc(models->refs,  (models->obj_n + 1) * sizeof(XPLMObjectRef))) ||
-                !(models->names = realloc(models->names, (models->obj_n + 1) * sizeof(char*))) ||
-                !(models->names[models->obj_n] = malloc(strlen(respath) + strlen(name) + 1)))
-            {
-                XPLMDebugString("SeaTraffic: Out of memory!");
-                return 0;
-            }
-
-            strcpy(models->names[models->obj_n], respath);
-            strcat(models->names[models->obj_n], name);
-            if ((models->refs[models->obj_n] = loadobject(models->names[models->obj_n])))
-                models->obj_n ++;
+            char path[PATH_MAX];
+            strcpy(path, respath);
+            strcat(path, name);
+            libraryloadfn(path, &load);
         }
         else
         {
             /* Library resource */
-            XPLMLookupObjects(name, 0.0f, 0.0f, libraryloadimmediate, models);
+            XPLMLookupObjects(name, 0.0f, 0.0f, libraryloadfn, &load);
         }
-        if (models->obj_n <= 0)
+        if (models->obj_n <= 0)		/* Not found. Async loads that fail are caught in startuploaded(). */
         {
             XPLMDebugString("SeaTraffic: Can't find object \"");
             XPLMDebugString(name);
@@ -229,5 +670,13 @@ int models_init(char *respath)
             return 0;
         }
     }
+    startuploaded();	/* All loads have been started */
     return -1;
 }
+
+
+/* Did some kind of ship end up with no default model? */
+int models_failed(void)
+{
+    return startup_failed;
+}
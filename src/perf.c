@@ -0,0 +1,349 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ */
+
+#include "seatraffic.h"
+
+#if IBM
+#  include <windows.h>
+#elif APL
+#  include <mach/mach_time.h>
+#endif
+
+#if IBM || APL
+static double us_per_tick;
+#endif
+
+/* Timings for one phase */
+typedef struct
+{
+    double frame;		/* Accumulated so far this frame [us] */
+    int calls;			/* Calls so far this frame */
+    int items;			/* Things processed so far this frame, e.g. ships drawn */
+    float last, avg, max;	/* Published: last complete frame, smoothed, and worst in the last PERF_WINDOW [us] */
+    int last_calls;
+    float window_max;		/* Worst so far in this PERF_WINDOW [us] */
+    XPLMDataRef refs[4];
+    unsigned int hist[PERF_HIST_MAX];	/* Distribution of per-frame totals */
+} perf_stat_t;
+
+/* One frame in the trace */
+typedef struct
+{
+    double time;				/* End of frame [us] */
+    float us[perf_phase_count];			/* Time spent in each phase */
+    unsigned short calls[perf_phase_count];
+    unsigned short items[perf_phase_count];
+    unsigned short active;			/* Number of active routes */
+} perf_trace_t;
+
+/* recalc, update, reflect, shadow and base don't overlap, so add up to our time in the frame - recalc runs inside update
+ * but is taken out of it. probe and local are parts of update, and are timed within it. */
+static const char *perf_names[perf_phase_count] = { "recalc", "update", "probe", "local", "reflect", "shadow", "base" };
+static perf_stat_t stats[perf_phase_count];
+static double window_start = 0;
+static perf_trace_t *trace = NULL;		/* Ring buffer of the last PERF_TRACE_MAX frames, or NULL if not recording */
+static int trace_n = 0;				/* Number of frames recorded */
+
+
+/* Initialisation - calibrate clock */
+void perf_init(void)
+{
+#if IBM
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    us_per_tick = 1000000.0 / (double) freq.QuadPart;
+#elif APL
+    mach_timebase_info_data_t info;
+    mach_timebase_info(&info);
+    us_per_tick = (double) info.numer / (info.denom * 1000.0);
+#endif
+}
+
+
+/* Monotonic high-resolution clock [us] */
+double perf_time(void)
+{
+#if IBM
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (double) t.QuadPart * us_per_tick;
+#elif APL
+    return (double) mach_absolute_time() * us_per_tick;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec * 1000000.0 + (double) t.tv_nsec * 0.001;
+#endif
+}
+
+
+/* Accumulate time spent in a phase since start. Returns the current time so that consecutive phases can be chained. */
+double perf_add(perf_phase_t phase, double start)
+{
+    double now = perf_time();
+    stats[phase].frame += now - start;
+    stats[phase].calls ++;
+    return now;
+}
+
+
+/* Accumulate time spent in a phase that runs inside another, and take it out of the other's time so that their times
+ * add up. Returns the current time. */
+double perf_add_nested(perf_phase_t phase, perf_phase_t outer, double start)
+{
+    double now = perf_add(phase, start);
+    stats[outer].frame -= now - start;
+    return now;
+}
+
+
+/* Count things processed in a phase */
+void perf_count(perf_phase_t phase, int n)
+{
+    stats[phase].items += n;
+}
+
+
+/* Histogram bucket for a duration. Buckets are exact below PERF_HIST_SUB us, and above that there are PERF_HIST_SUB
+ * buckets per power of two, so the bucket width is never more than 1/PERF_HIST_SUB of the value. */
+static int histbucket(double us)
+{
+    unsigned int v;
+    int e;
+
+    if (us >= (double) (1 << 24)) { return PERF_HIST_MAX-1; }
+    v = us > 0 ? (unsigned int) us : 0;
+    if (v < PERF_HIST_SUB) { return v; }
+    for (e=3; v >> (e+1); e++);		/* e = floor(log2(v)) */
+    return (e-2) * PERF_HIST_SUB + (v >> (e-3)) - PERF_HIST_SUB;
+}
+
+/* Smallest duration that falls in a bucket [us] */
+static unsigned int histlow(int bucket)
+{
+    if (bucket < PERF_HIST_SUB) { return bucket; }
+    return (unsigned int) (bucket % PERF_HIST_SUB + PERF_HIST_SUB) << (bucket / PERF_HIST_SUB - 1);
+}
+
+
+/* End of frame - publish this frame's timings */
+void perf_frame(int active_n)
+{
+    int i;
+    double now = perf_time();
+    int new_window = (now - window_start >= PERF_WINDOW * 1000000.0);
+    perf_trace_t *record = NULL;
+
+    if (new_window) { window_start = now; }
+    if (trace)
+    {
+        record = trace + (trace_n++ % PERF_TRACE_MAX);
+        record->time = now;
+        record->active = active_n;
+    }
+    for (i=0; i<perf_phase_count; i++)
+    {
+        perf_stat_t *stat = stats + i;
+        if (stat->calls) { stat->hist[histbucket(stat->frame)] ++; }
+        if (record)
+        {
+            record->us[i] = (float) stat->frame;
+            record->calls[i] = stat->calls;
+            record->items[i] = stat->items;
+        }
+        stat->last = (float) stat->frame;
+        stat->last_calls = stat->calls;
+        stat->avg += (stat->last - stat->avg) * PERF_SMOOTHING;
+        if (stat->last > stat->window_max) { stat->window_max = stat->last; }
+        if (new_window)
+        {
+            stat->max = stat->window_max;
+            stat->window_max = 0;
+        }
+        stat->frame = 0;
+        stat->calls = 0;
+        stat->items = 0;
+    }
+}
+
+
+/* Start or stop recording the per-frame trace. Returns whether recording. */
+int perf_trace(int enable)
+{
+    if (enable && !trace)
+    {
+        trace_n = 0;
+        if (!(trace = malloc(PERF_TRACE_MAX * sizeof(perf_trace_t))))
+            XPLMDebugString("SeaTraffic: Out of memory!");
+    }
+    else if (!enable)
+    {
+        free(trace);
+        trace = NULL;
+    }
+    return trace != NULL;
+}
+
+
+/* Duration below which a proportion p of a phase's frames fall [us] */
+static unsigned int percentile(perf_stat_t *stat, unsigned int total, double p)
+{
+    int i;
+    unsigned int n = 0;
+    for (i=0; i<PERF_HIST_MAX-1; i++)
+        if ((n += stat->hist[i]) >= p * total)
+            break;
+    return histlow(i+1);
+}
+
+
+static FILE *dumpopen(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    FILE *h;
+    strcpy(path, dir);
+    strcat(path, name);
+    if (!(h = fopen(path, "w")))
+    {
+        XPLMDebugString("SeaTraffic: Can't write ");
+        XPLMDebugString(path);
+        XPLMDebugString("\n");
+    }
+    return h;
+}
+
+/* Write the histograms, and the trace if recording, to files in dir */
+void perf_dump(const char *dir)
+{
+    int i, j, first, last;
+    char buf[160];
+    FILE *h;
+
+    /* Histograms, and a summary in Log.txt */
+    if (!(h = dumpopen(dir, "SeaTraffic-histogram.csv"))) { return; }
+    fprintf(h, "from_us,to_us");
+    for (i=0; i<perf_phase_count; i++)
+        fprintf(h, ",%s", perf_names[i]);
+    fprintf(h, "\n");
+    for (first=0; first<PERF_HIST_MAX-1; first++)
+    {
+        for (i=0; i<perf_phase_count && !stats[i].hist[first]; i++);
+        if (i<perf_phase_count) { break; }
+    }
+    for (last=PERF_HIST_MAX-1; last>first; last--)
+    {
+        for (i=0; i<perf_phase_count && !stats[i].hist[last]; i++);
+        if (i<perf_phase_count) { break; }
+    }
+    for (j=first; j<=last; j++)
+    {
+        fprintf(h, "%u,%u", histlow(j), histlow(j+1));
+        for (i=0; i<perf_phase_count; i++)
+            fprintf(h, ",%u", stats[i].hist[j]);
+        fprintf(h, "\n");
+    }
+    fclose(h);
+
+    for (i=0; i<perf_phase_count; i++)
+    {
+        unsigned int total = 0;
+        for (j=0; j<PERF_HIST_MAX; j++)
+            total += stats[i].hist[j];
+        if (!total) { continue; }
+        sprintf(buf, "SeaTraffic: %-7s %8u frames, 50%% <%6uus, 99%% <%6uus, 99.9%% <%6uus, worst <%6uus\n", perf_names[i], total,
+                percentile(stats+i, total, 0.5), percentile(stats+i, total, 0.99), percentile(stats+i, total, 0.999), percentile(stats+i, total, 1));
+        XPLMDebugString(buf);
+    }
+
+    if (!trace || !trace_n) { return; }
+    first = trace_n > PERF_TRACE_MAX ? trace_n - PERF_TRACE_MAX : 0;
+
+    /* Trace as CSV */
+    if (!(h = dumpopen(dir, "SeaTraffic-trace.csv"))) { return; }
+    fprintf(h, "time_us,active");
+    for (i=0; i<perf_phase_count; i++)
+        fprintf(h, ",%s_us,%s_calls,%s_items", perf_names[i], perf_names[i], perf_names[i]);
+    fprintf(h, "\n");
+    for (j=first; j<trace_n; j++)
+    {
+        perf_trace_t *record = trace + j % PERF_TRACE_MAX;
+        fprintf(h, "%.0f,%d", record->time - trace[first % PERF_TRACE_MAX].time, record->active);
+        for (i=0; i<perf_phase_count; i++)
+            fprintf(h, ",%.1f,%d,%d", (double) record->us[i], record->calls[i], record->items[i]);
+        fprintf(h, "\n");
+    }
+    fclose(h);
+
+    /* Trace as counter events in Chrome's Trace Event Format, for chrome://tracing */
+    if (!(h = dumpopen(dir, "SeaTraffic-trace.json"))) { return; }
+    fprintf(h, "{\"traceEvents\":[\n");
+    for (j=first; j<trace_n; j++)
+    {
+        perf_trace_t *record = trace + j % PERF_TRACE_MAX;
+        double ts = record->time - trace[first % PERF_TRACE_MAX].time;
+        fprintf(h, "{\"name\":\"phases_us\",\"ph\":\"C\",\"pid\":1,\"ts\":%.0f,\"args\":{", ts);
+        for (i=0; i<perf_phase_count; i++)
+            if (i != perf_probe && i != perf_local)	/* Counters are stacked, and these are parts of update */
+                fprintf(h, "%s\"%s\":%.1f", i ? "," : "", perf_names[i], (double) record->us[i]);
+        fprintf(h, "}},\n{\"name\":\"update_parts_us\",\"ph\":\"C\",\"pid\":1,\"ts\":%.0f,\"args\":{\"%s\":%.1f,\"%s\":%.1f}},\n",
+                ts, perf_names[perf_probe], (double) record->us[perf_probe], perf_names[perf_local], (double) record->us[perf_local]);
+        fprintf(h, "{\"name\":\"ships\",\"ph\":\"C\",\"pid\":1,\"ts\":%.0f,\"args\":{\"active\":%d,\"drawn\":%d,\"probes\":%d,\"recalcs\":%d}}%s\n",
+                ts, record->active, record->items[perf_base], record->calls[perf_probe], record->calls[perf_recalc], j<trace_n-1 ? "," : "");
+    }
+    fprintf(h, "],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(h);
+}
+
+
+void perf_stats(perf_phase_t phase, float *last, float *avg, float *max)
+{
+    *last = stats[phase].last;
+    *avg  = stats[phase].avg;
+    *max  = stats[phase].max;
+}
+
+
+/* Dataref accessors */
+static float getperff(void *inRefcon)
+{
+    return *(float *) inRefcon;
+}
+
+static int getperfi(void *inRefcon)
+{
+    return *(int *) inRefcon;
+}
+
+
+/* Publish timings as marginal/seatraffic/perf/<phase>_us, _avg_us, _max_us and _calls */
+void perf_register(void)
+{
+    int i;
+    char name[64];
+
+    for (i=0; i<perf_phase_count; i++)
+    {
+        perf_stat_t *stat = stats + i;
+        sprintf(name, DATAREF_PREFIX "perf/%s_us", perf_names[i]);
+        stat->refs[0] = XPLMRegisterDataAccessor(name, xplmType_Float, 0, NULL, NULL, getperff, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &stat->last, NULL);
+        sprintf(name, DATAREF_PREFIX "perf/%s_avg_us", perf_names[i]);
+        stat->refs[1] = XPLMRegisterDataAccessor(name, xplmType_Float, 0, NULL, NULL, getperff, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &stat->avg, NULL);
+        sprintf(name, DATAREF_PREFIX "perf/%s_max_us", perf_names[i]);
+        stat->refs[2] = XPLMRegisterDataAccessor(name, xplmType_Float, 0, NULL, NULL, getperff, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &stat->max, NULL);
+        sprintf(name, DATAREF_PREFIX "perf/%s_calls", perf_names[i]);
+        stat->refs[3] = XPLMRegisterDataAccessor(name, xplmType_Int, 0, getperfi, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &stat->last_calls, NULL);
+    }
+}
+
+
+void perf_unregister(void)
+{
+    int i, j;
+    for (i=0; i<perf_phase_count; i++)
+        for (j=0; j<4; j++)
+            XPLMUnregisterDataAccessor(stats[i].refs[j]);
+}
@@ -0,0 +1,265 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ */
+
+#include "seatraffic.h"
+#include "query.h"
+
+/* Answers other plugins' queries for ships near a location - see query.h for the interface.
+ *
+ * The active ships are bucketed into a uniform grid over their bounding box, sized to hold about one ship per cell.
+ * The grid is built on the first query of each frame, so costs nothing if no other plugin is asking. Radius queries
+ * only visit the cells that overlap the search circle, and nearest queries visit rings of cells outwards from the
+ * search location until no unvisited cell can hold anything nearer than what they've already found. */
+
+typedef struct
+{
+    double lat, lon;		/* lon is relative to grid_lon, in [-180,180) */
+    query_ship_t ship;
+} query_entry_t;
+
+static active_route_t *query_routes = NULL;	/* Ships as of the last frame */
+static int grid_valid = 0;
+static query_entry_t entries[ACTIVE_MAX];	/* Ships, sorted by cell */
+static query_entry_t unsorted[ACTIVE_MAX];
+static int entry_cell[ACTIVE_MAX];		/* Cell of each unsorted entry */
+static int entry_n;
+static int cell_start[QUERY_CELLS_MAX+1];	/* Index of first entry in each cell */
+static int grid_w, grid_h;			/* Number of cells east-west and north-south */
+static double grid_lat, grid_lon;		/* South-west corner */
+static double cell_lat, cell_lon;		/* Size of a cell [degrees] */
+static double cell_size;			/* Size of a cell [m] */
+static double grid_coslat;
+
+
+/* Longitude difference, wrapped to [-180,180) */
+static inline double lonwrap(double dlon)
+{
+    if (dlon >= 180) { return dlon - 360; }
+    else if (dlon < -180) { return dlon + 360; }
+    return dlon;
+}
+
+/* Square of distance from a query location, using its cos(latitude) [m^2] */
+static inline double querydistance2(double lat, double lon, double coslat, const query_entry_t *e)
+{
+    double dlat = (e->lat - lat) * (double) DEG_LENGTH;
+    double dlon = lonwrap(e->lon - lon) * (double) DEG_LENGTH * coslat;
+    return dlat*dlat + dlon*dlon;
+}
+
+
+/* Bucket the first entry_n entries of unsorted into the grid */
+static void gridbuild(void)
+{
+    double min_lat=90, max_lat=-90, min_lon=180, max_lon=-180, width, height;
+    int i, count[QUERY_CELLS_MAX];
+
+    grid_valid = 1;
+    if (!entry_n)
+    {
+        grid_w = grid_h = 0;
+        return;
+    }
+
+    /* Bounding box, in longitudes relative to the first ship so that it is unaffected by the antimeridian */
+    grid_lon = unsorted[0].ship.lon;
+    for (i=0; i<entry_n; i++)
+    {
+        unsorted[i].lat = unsorted[i].ship.lat;
+        unsorted[i].lon = lonwrap(unsorted[i].ship.lon - grid_lon);
+        if (unsorted[i].lat < min_lat) { min_lat = unsorted[i].lat; }
+        if (unsorted[i].lat > max_lat) { max_lat = unsorted[i].lat; }
+        if (unsorted[i].lon < min_lon) { min_lon = unsorted[i].lon; }
+        if (unsorted[i].lon > max_lon) { max_lon = unsorted[i].lon; }
+    }
+    grid_coslat = cos((min_lat + max_lat) * (M_PI/360));
+    width = (max_lon - min_lon) * (double) DEG_LENGTH * grid_coslat;
+    height = (max_lat - min_lat) * (double) DEG_LENGTH;
+
+    /* About one ship per cell */
+    cell_size = sqrt(width * height / entry_n);
+    if (cell_size < QUERY_CELL_MIN) { cell_size = QUERY_CELL_MIN; }
+    while (1)
+    {
+        grid_w = (int) (width / cell_size) + 1;
+        grid_h = (int) (height / cell_size) + 1;
+        if (grid_w * grid_h <= QUERY_CELLS_MAX) { break; }
+        cell_size *= 1.5;	/* long and thin */
+    }
+    cell_lat = cell_size / (double) DEG_LENGTH;
+    cell_lon = cell_size / ((double) DEG_LENGTH * grid_coslat);
+    grid_lat = min_lat;
+    for (i=0; i<entry_n; i++)
+        unsorted[i].lon -= min_lon;
+    grid_lon = grid_lon + min_lon;	/* entries' lon is now relative to the west edge */
+
+    /* Counting sort by cell */
+    memset(count, 0, grid_w * grid_h * sizeof(int));
+    for (i=0; i<entry_n; i++)
+    {
+        int x = (int) (unsorted[i].lon / cell_lon), y = (int) ((unsorted[i].lat - grid_lat) / cell_lat);
+        if (x >= grid_w) { x = grid_w-1; }	/* rounding */
+        if (y >= grid_h) { y = grid_h-1; }
+        count[entry_cell[i] = y * grid_w + x]++;
+    }
+    cell_start[0] = 0;
+    for (i=0; i<grid_w * grid_h; i++)
+    {
+        cell_start[i+1] = cell_start[i] + count[i];
+        count[i] = cell_start[i];
+    }
+    for (i=0; i<entry_n; i++)
+        entries[count[entry_cell[i]]++] = unsorted[i];
+}
+
+/* Snapshot the ships of the last frame and index them */
+static void gridupdate(void)
+{
+    active_route_t *a;
+
+    for (a=query_routes, entry_n=0; a && entry_n<ACTIVE_MAX; a=a->next, entry_n++)
+    {
+        query_ship_t *ship = &unsorted[entry_n].ship;
+        ship->id = a->id;
+        ship->kind = a->route->ship_kind;
+        ship->lat = a->loc.lat;
+        ship->lon = a->loc.lon;
+        ship->alt = (float) a->altmsl;
+        ship->heading = a->drawinfo.heading;
+        ship->speed = (a->last_node+a->direction < 0 || a->last_node+a->direction >= a->route->pathlen) ? 0 : (float) a->ship->speed;
+        ship->distance = 0;
+    }
+    gridbuild();
+}
+
+/* Cell co-ordinate, clamped to the grid */
+static inline int cellclamp(double offset, double size, int n)
+{
+    if (offset < 0) { return 0; }
+    offset /= size;
+    return offset >= n ? n-1 : (int) offset;
+}
+
+
+/* Ships within radius, in no particular order. Returns the number found, which may be more than max. */
+static int queryradius(double lat, double lon, double radius, query_ship_t *ships, int max, int *count)
+{
+    double coslat = cos(lat * (M_PI/180)), radius2 = radius * radius, dlat, dlon;
+    int x, y, x0, x1, y0, y1, i, found=0;
+
+    *count = 0;
+    if (!grid_w) { return 0; }
+
+    dlat = radius / (double) DEG_LENGTH;
+    dlon = coslat > 1e-6 ? radius / ((double) DEG_LENGTH * coslat) : 360;
+    lon = lonwrap(lon - grid_lon);
+    if (lat + dlat < grid_lat || lat - dlat > grid_lat + grid_h * cell_lat || lon + dlon < 0 || lon - dlon > grid_w * cell_lon)
+        return 0;	/* Doesn't overlap the grid */
+    x0 = cellclamp(lon - dlon, cell_lon, grid_w);
+    x1 = cellclamp(lon + dlon, cell_lon, grid_w);
+    y0 = cellclamp(lat - dlat - grid_lat, cell_lat, grid_h);
+    y1 = cellclamp(lat + dlat - grid_lat, cell_lat, grid_h);
+
+    for (y=y0; y<=y1; y++)
+        for (x=x0; x<=x1; x++)
+            for (i=cell_start[y*grid_w+x]; i<cell_start[y*grid_w+x+1]; i++)
+            {
+                double d2 = querydistance2(lat, lon, coslat, entries+i);
+                if (d2 <= radius2)
+                {
+                    if (*count < max)
+                    {
+                        ships[*count] = entries[i].ship;
+                        ships[(*count)++].distance = (float) sqrt(d2);
+                    }
+                    found++;
+                }
+            }
+    return found;
+}
+
+/* Insert into the k nearest so far, which are sorted by distance */
+static inline void nearestadd(query_ship_t *ships, int k, int *count, const query_entry_t *e, double d)
+{
+    int i;
+
+    if (*count == k && d >= (double) ships[k-1].distance) { return; }
+    for (i = (*count < k ? (*count)++ : k-1); i && (double) ships[i-1].distance > d; i--)
+        ships[i] = ships[i-1];
+    ships[i] = e->ship;
+    ships[i].distance = (float) d;
+}
+
+/* Up to k nearest ships within radius (or any distance if radius is 0), nearest first. Returns the number found. */
+static int querynearest(double lat, double lon, double radius, query_ship_t *ships, int k)
+{
+    double coslat = cos(lat * (M_PI/180)), ring_dist;
+    int cx, cy, r, x, y, i, count=0;
+
+    if (!grid_w || k <= 0) { return 0; }
+    if (radius <= 0) { radius = 1e30; }	/* unlimited */
+
+    lon = lonwrap(lon - grid_lon);
+    cx = cellclamp(lon, cell_lon, grid_w);
+    cy = cellclamp(lat - grid_lat, cell_lat, grid_h);
+
+    /* Anything outside ring r is at least r*ring_dist from the search location */
+    ring_dist = cell_size * (coslat < grid_coslat ? coslat / grid_coslat : 1);
+
+    for (r=0; ; r++)
+    {
+        for (y=cy-r; y<=cy+r; y++)
+        {
+            int step = (y==cy-r || y==cy+r) ? 1 : 2*r;	/* just the ring's perimeter */
+            if (y < 0 || y >= grid_h) { continue; }
+            for (x=cx-r; x<=cx+r; x+=step)
+            {
+                if (x < 0 || x >= grid_w) { continue; }
+                for (i=cell_start[y*grid_w+x]; i<cell_start[y*grid_w+x+1]; i++)
+                {
+                    double d = sqrt(querydistance2(lat, lon, coslat, entries+i));
+                    if (d <= radius) { nearestadd(ships, k, &count, entries+i, d); }
+                }
+            }
+        }
+        if (cx-r <= 0 && cy-r <= 0 && cx+r >= grid_w-1 && cy+r >= grid_h-1) { break; }	/* visited the whole grid */
+        if ((double) r * ring_dist > radius) { break; }
+        if (count == k && (double) r * ring_dist >= (double) ships[k-1].distance) { break; }
+    }
+    return count;
+}
+
+
+/* Called each frame with the current active routes, or with NULL if they're about to be freed */
+void query_frame(active_route_t *active_routes)
+{
+    query_routes = active_routes;
+    grid_valid = 0;
+}
+
+/* Handle a message from another plugin. Returns 0 if it's not a query. */
+int query_message(long inMessage, void *inParam)
+{
+    query_t *query = inParam;
+
+    if (inMessage != QUERY_MSG_RADIUS && inMessage != QUERY_MSG_NEAREST) { return 0; }
+
+    if (!query) { return -1; }
+    if (query->version != QUERY_VERSION || query->max < 0 || (query->max && !query->ships))
+    {
+        query->count = -1;
+        return -1;
+    }
+    if (!grid_valid) { gridupdate(); }
+
+    if (inMessage == QUERY_MSG_RADIUS)
+        query->found = queryradius(query->lat, query->lon, (double) query->radius, query->ships, query->max, &query->count);
+    else
+        query->found = query->count = querynearest(query->lat, query->lon, (double) query->radius, query->ships, query->max);
+    return -1;
+}
+
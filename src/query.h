@@ -0,0 +1,58 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Interface for other plugins to ask SeaTraffic which ships are near a location.
+ * This file is self-contained so that it can be included by other plugins.
+ *
+ * Fill in a query_t and send it with XPLMSendMessageToPlugin to the plugin found by
+ * XPLMFindPluginBySignature(QUERY_SIGNATURE). The plugin answers synchronously, so the results are in the query_t
+ * and the caller's ships buffer when XPLMSendMessageToPlugin returns. For example:
+ *
+ *   query_ship_t near[8];
+ *   query_t query = { QUERY_VERSION };
+ *   query.lat = my_lat; query.lon = my_lon; query.radius = 5000; query.max = 8; query.ships = near;
+ *   XPLMSendMessageToPlugin(XPLMFindPluginBySignature(QUERY_SIGNATURE), QUERY_MSG_NEAREST, &query);
+ *
+ * QUERY_MSG_RADIUS returns ships within radius of lat,lon in no particular order, up to max of them.
+ * QUERY_MSG_NEAREST returns the max ships nearest to lat,lon, nearest first, ignoring any further than radius if
+ * radius is non-zero.
+ *
+ * Only ships that SeaTraffic is currently simulating, i.e. those within marginal/seatraffic/render_radius_m of the
+ * user's plane, are known. Positions are as of the last frame, and may lag by a few frames for ships far from the
+ * viewer. Distances use a flat-earth approximation centred on lat,lon, which is good to about 1% within 50km away from
+ * the poles.
+ */
+
+#ifndef SEATRAFFIC_QUERY_H
+#define SEATRAFFIC_QUERY_H
+
+#define QUERY_SIGNATURE "Marginal.SeaTraffic"
+#define QUERY_MSG_RADIUS  0x53540001	/* 'ST' - outside the range reserved for X-Plane's own messages */
+#define QUERY_MSG_NEAREST 0x53540002
+#define QUERY_VERSION 1
+
+typedef struct
+{
+    unsigned int id;		/* Unique for the life of a ship - same as in the shared memory export */
+    unsigned int kind;		/* 0=leisure, tourist, cruise, ped/sml, ped/med, veh/sml, veh/med, veh/big, cargo, 9=tanker */
+    double lat, lon;		/* [degrees] */
+    float alt;			/* MSL [m] */
+    float heading;		/* True [degrees] */
+    float speed;		/* [m/s] - 0 while docked */
+    float distance;		/* From the query location [m] */
+} query_ship_t;
+
+typedef struct
+{
+    int version;		/* in: QUERY_VERSION */
+    double lat, lon;		/* in: Location to search around [degrees] */
+    float radius;		/* in: Search radius [m] */
+    int max;			/* in: Size of the ships buffer */
+    query_ship_t *ships;	/* in: Caller's buffer for the results */
+    int count;			/* out: Number of ships written to the buffer, or -1 if the query wasn't understood */
+    int found;			/* out: QUERY_MSG_RADIUS only - number of ships within radius, which may be more than max */
+} query_t;
+
+#endif	/* SEATRAFFIC_QUERY_H */
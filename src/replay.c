@@ -0,0 +1,155 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ */
+
+#include "seatraffic.h"
+
+#include <stddef.h>
+
+/* Recording and replay of the simulator inputs that drive the plugin.
+ *
+ * File format, in the byte order of the machine that made the recording:
+ *   header:  replay_header_t
+ *   records: one per frame - unsigned short mask of the fields that changed since the previous record, followed by
+ *            the changed fields
+ */
+
+#define REPLAY_MAGIC "STRI"
+#define REPLAY_VERSION 2
+#define REPLAY_BYTEORDER 0x01020304
+
+typedef struct
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int byteorder;
+    unsigned int fields;	/* Number of fields in each record */
+    unsigned int seed;		/* RNG seed used while recording */
+} replay_header_t;
+
+/* Fields of sim_input_t. Order must not change without bumping REPLAY_VERSION */
+static const struct
+{
+    size_t offset, size;
+} fields[] =
+{
+    { offsetof(sim_input_t, plane_lat),   sizeof(double) },
+    { offsetof(sim_input_t, plane_lon),   sizeof(double) },
+    { offsetof(sim_input_t, plane_gs),    sizeof(float) },
+    { offsetof(sim_input_t, plane_track), sizeof(float) },
+    { offsetof(sim_input_t, view_x),      sizeof(float) },
+    { offsetof(sim_input_t, view_y),      sizeof(float) },
+    { offsetof(sim_input_t, view_z),      sizeof(float) },
+    { offsetof(sim_input_t, view_h),      sizeof(float) },
+    { offsetof(sim_input_t, night),       sizeof(float) },
+    { offsetof(sim_input_t, monotonic),   sizeof(float) },
+    { offsetof(sim_input_t, renopt),      sizeof(int) },
+};
+#define FIELD_COUNT (sizeof(fields)/sizeof(fields[0]))
+
+static FILE *record_h = NULL, *replay_h = NULL;
+static sim_input_t record_state, replay_state;	/* Inputs as of the last record written / read */
+static int record_n, replay_n;
+
+
+/* Start recording to path. Returns 0 on failure. */
+int record_start(const char *path, unsigned int seed)
+{
+    replay_header_t header = { REPLAY_MAGIC, REPLAY_VERSION, REPLAY_BYTEORDER, FIELD_COUNT, 0 };
+
+    record_stop();
+    header.seed = seed;
+    if (!(record_h = fopen(path, "wb")) || fwrite(&header, sizeof(header), 1, record_h) != 1)
+    {
+        XPLMDebugString("SeaTraffic: Can't write ");
+        XPLMDebugString(path);
+        XPLMDebugString("\n");
+        record_stop();
+        return 0;
+    }
+    record_n = 0;
+    return -1;
+}
+
+
+/* Append the inputs for one frame */
+void record_input(const sim_input_t *input)
+{
+    unsigned short mask = 0;
+    int i;
+
+    if (!record_h) { return; }
+    for (i=0; i<FIELD_COUNT; i++)
+        if (!record_n || memcmp((char *) input + fields[i].offset, (char *) &record_state + fields[i].offset, fields[i].size))
+            mask |= 1 << i;
+    fwrite(&mask, sizeof(mask), 1, record_h);
+    for (i=0; i<FIELD_COUNT; i++)
+        if (mask & (1 << i))
+            fwrite((char *) input + fields[i].offset, fields[i].size, 1, record_h);
+    record_state = *input;
+    record_n++;
+}
+
+
+void record_stop(void)
+{
+    char buf[80];
+    if (!record_h) { return; }
+    fclose(record_h);
+    record_h = NULL;
+    sprintf(buf, "SeaTraffic: Recorded %d frames\n", record_n);
+    XPLMDebugString(buf);
+}
+
+
+/* Start replaying from path. Returns 0 on failure. */
+int replay_start(const char *path, unsigned int *seed)
+{
+    replay_header_t header;
+
+    replay_stop();
+    if (!(replay_h = fopen(path, "rb")) ||
+        fread(&header, sizeof(header), 1, replay_h) != 1 ||
+        strncmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) ||
+        header.version != REPLAY_VERSION || header.byteorder != REPLAY_BYTEORDER || header.fields != FIELD_COUNT)
+    {
+        XPLMDebugString("SeaTraffic: Can't replay ");
+        XPLMDebugString(path);
+        XPLMDebugString("\n");
+        replay_stop();
+        return 0;
+    }
+    *seed = header.seed;
+    replay_n = 0;
+    return -1;
+}
+
+
+/* Read the inputs for the next frame. Returns 0 at the end of the recording. */
+int replay_input(sim_input_t *input)
+{
+    unsigned short mask;
+    int i;
+
+    if (!replay_h || fread(&mask, sizeof(mask), 1, replay_h) != 1) { return 0; }
+    for (i=0; i<FIELD_COUNT; i++)
+        if ((mask & (1 << i)) && fread((char *) &replay_state + fields[i].offset, fields[i].size, 1, replay_h) != 1)
+            return 0;
+    *input = replay_state;
+    replay_n++;
+    return -1;
+}
+
+
+void replay_stop(void)
+{
+    char buf[80];
+    if (!replay_h) { return; }
+    fclose(replay_h);
+    replay_h = NULL;
+    sprintf(buf, "SeaTraffic: Replayed %d frames\n", replay_n);
+    XPLMDebugString(buf);
+}
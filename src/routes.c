@@ -7,11 +7,89 @@
 
 #include "seatraffic.h"
 
+#if IBM
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#endif
+
+/* Ship types. Order must match ship_kind_t enum. Tokens are as in routes.txt. */
+const ship_t ships[ship_kind_count] =
+{
+    /* speed [m/s], semilen [m], token */
+    {  2,  8, "leisure" },	/*  ~4   knots */
+    {  3, 15, "tourist" },	/*  ~6   knots */
+    { 12, 80, "cruise"  },	/* ~23.5 knots */
+    { 11, 11, "ped/sml" },	/* ~21.5 knots */
+    { 16, 21, "ped/med" },	/* ~31   knots */
+    {  5, 11, "veh/sml" },	/*  ~9.5 knots */
+    {  6, 30, "veh/med" },	/* ~11.5 knots */
+    { 10, 76, "veh/big" },	/* ~19.5 knots */
+    {  8, 95, "cargo"   },	/* ~15.5 knots */
+    {  8,125, "tanker"  },	/* ~15.5 knots */
+};
+
 /* Globals */
 static route_list_t *routes[180][360];	/* array of link lists of routes by tile */
+static int route_n = 0;			/* number of routes read */
+static int block_n[(180+SUPERBLOCK-1)/SUPERBLOCK][360/SUPERBLOCK];	/* number of tile entries in each superblock */
+static route_t **all_routes = NULL;	/* every route, in the order read - only kept while interning */
+static int all_routes_max = 0;
+
+/* Route paths are stored as sequences of shared polyline segments. Paths are split into segments at junctions - nodes
+ * that appear in more than one route - and identical segments are stored once. Segments are stored in a canonical
+ * direction, and routes refer to them as (segment index << 1 | reversed).
+ * Each segment's points are stored in seg_bytes as latitude and longitude in units of PATH_QUANTUM, each as a zigzag
+ * varint delta from the previous point (or from 0,0 for the first point). */
+typedef struct
+{
+    unsigned int first;		/* Offset of first point in seg_bytes */
+    unsigned short len;		/* Number of points */
+} segment_t;
+
+static unsigned char *seg_bytes = NULL;
+static segment_t *segments = NULL;
+static int seg_bytes_n = 0, seg_bytes_max = 0, segment_n = 0, segment_max = 0;
+static int seg_pts_n = 0;			/* Number of points in all segments */
+static int intern_nodes = 0, intern_refs = 0;	/* Route nodes and segment references before and after interning */
+
+/* Background loading of routes.txt */
+#if IBM
+static HANDLE loader = NULL;
+#else
+static pthread_t loader;
+#endif
+static int loader_running = 0;		/* Thread started but not yet joined */
+static volatile int loader_done = 0;	/* Set by the thread when it's finished with routes[] */
+static int loader_result;
+static double loader_time;		/* How long the thread took [us] */
+static char loader_path[PATH_MAX], loader_err[256];
+
+#if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
+/* Route names are only needed for the local map and the debug window, so they're read from routes.txt when first asked
+ * for, into a single pool of unique strings */
+static char *name_pool = NULL;
+static int name_pool_n = 0, name_pool_max = 0;
+static int *name_table = NULL;		/* Hash table of offset+1 of each name in name_pool */
+static int name_table_size = 0, name_n = 0;
+static FILE *name_h = NULL;		/* routes.txt, kept open while names are in use */
+#endif
 
 /* prototypes */
 static int addroutetotile(route_t *route);
+static int internroutes(char *err);
+
+
+/* Split a route's header line into ship type and name, and return the name */
+static char *splitheader(char *c)
+{
+    char *name=c;
+    while ((*name) && !isspace(*name)) { name++; }	/* split line into shiptype and name */
+    while ((*name) && isspace(*name)) { *(name++)=0; }	/* split line into shiptype and name */
+    c=name+strlen(name)-1;				/* name is utf-8 encoded, which X-Plane can render */
+    while ((c>=name) && isspace(*c)) { *(c--)=0; };	/* rtrim */
+    return name;
+}
 
 
 int readroutes(char *mypath, char *err)
@@ -19,6 +97,7 @@ int readroutes(char *mypath, char *err)
     char buffer[PATH_MAX], *c;
     FILE *h;
     int lineno=0;
+    long pos=0;		/* Offset of the current line */
     route_t *currentroute=NULL;
 
     strcpy(buffer, mypath);
@@ -69,6 +148,7 @@ int readroutes(char *mypath, char *err)
                 strcpy(err, "Out of memory");
                 return 0;
             }
+            mem_add(mem_paths, !currentroute->pathlen, sizeof(loc_t));
             if (sscanf(c, "%f %f", &(currentroute->path[currentroute->pathlen].lat), &(currentroute->path[currentroute->pathlen].lon)) != 2)
             {
                 sprintf(err, "Invalid location at routes.txt line %d", lineno);
@@ -79,14 +159,13 @@ int readroutes(char *mypath, char *err)
         else				/* New route */
         {
             int i;
-            char *name=c;
-            while ((*name) && !isspace(*name)) { name++; }	/* split line into shiptype and name */
-            while ((*name) && isspace(*name)) { *(name++)=0; }	/* split line into shiptype and name */
+            splitheader(c);
             if (!(currentroute=calloc(1, sizeof(route_t))))
             {
                 strcpy(err, "Out of memory");
                 return 0;
             }
+            mem_add(mem_paths, 1, sizeof(route_t));
             for (i=0; i<ship_kind_count; i++)
             {
                 if (!strcmp(c, ships[i].token))
@@ -101,11 +180,10 @@ int readroutes(char *mypath, char *err)
                 return 0;
             }
 #if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
-            c=name+strlen(name)-1;				/* name is utf-8 encoded, which X-Plane can render */
-            while ((c>=name) && isspace(*c)) { *(c--)=0; };	/* rtrim */
-            currentroute->name=strdup(name);
+            currentroute->name_pos=pos;	/* Name is read later by route_name() */
 #endif
         }
+        pos=ftell(h);
         c=fgets(buffer, PATH_MAX, h);
     }
 
@@ -132,23 +210,181 @@ int readroutes(char *mypath, char *err)
 }
 
 
-/* Add a route to the tile list */
+/* Body of the loader thread. Mustn't call the XPLM API. */
+#if IBM
+static DWORD WINAPI loadroutes(LPVOID arg)
+#else
+static void *loadroutes(void *arg)
+#endif
+{
+    double start = perf_time();
+    loader_result = readroutes(loader_path, loader_err) && internroutes(loader_err);
+    loader_time = perf_time() - start;
+    loader_done = 1;
+    return 0;
+}
+
+
+/* Start reading routes.txt in the background */
+int routes_load(char *mypath, char *err)
+{
+    strcpy(loader_path, mypath);
+#if IBM
+    if (!(loader = CreateThread(NULL, 0, loadroutes, NULL, 0, NULL)))
+#else
+    if (pthread_create(&loader, NULL, loadroutes, NULL))
+#endif
+    {
+        strcpy(err, "Can't start thread to read routes.txt");
+        return 0;
+    }
+    loader_running = 1;
+    return 1;
+}
+
+
+/* Wait for the loader thread to exit */
+static void routes_join(void)
+{
+    if (!loader_running) return;
+#if IBM
+    WaitForSingleObject(loader, INFINITE);
+    CloseHandle(loader);
+#else
+    pthread_join(loader, NULL);
+#endif
+    loader_running = 0;
+}
+
+
+/* Have routes been read? Returns 0 if still reading, 1 if routes are available, -1 if reading failed */
+int routes_poll(char *err, double *elapsed, int *count)
+{
+    if (!loader_done) return 0;
+    routes_join();	/* Also guarantees visibility of everything the thread wrote */
+    *elapsed = loader_time;
+    *count = route_n;
+    if (loader_result) return 1;
+    strcpy(err, loader_err);
+    return -1;
+}
+
+
+/* Don't unload while the thread is still running */
+void routes_wait(void)
+{
+    routes_join();
+}
+
+
+/* Add a route to the list of a tile, unless it's already there */
+static int addtotile(route_t *route, int south, int west)
+{
+    route_list_t **route_list;
+
+    if (south < -90 || south > 89) { return 1; }
+    west = west < -180 ? west+360 : (west >= 180 ? west-360 : west);
+    route_list=&routes[south+90][west+180];
+    if (!*route_list || (*route_list)->route!=route)	/* We add from front so only need to check first route */
+    {
+        if (!route_list_add(route_list, route, mem_tiles)) { return 0; }
+        block_n[(south+90)/SUPERBLOCK][(west+180)/SUPERBLOCK]++;
+    }
+    return 1;
+}
+
+
+/* Add a route to the lists of the tiles that the straight line in lat/lon from a to b passes through, apart from a's
+ * tile, walking them in order by stepping into whichever of the next tile north/south and east/west the line reaches
+ * first (Amanatides & Woo). */
+static int addlinetotile(route_t *route, loc_t a, loc_t b)
+{
+    double lat0 = a.lat, lon0 = a.lon;
+    double dlat = (double) b.lat - lat0, dlon = (double) b.lon - lon0;
+    double next_lat, next_lon, step_lat, step_lon;
+    int south = (int) floor(lat0), west = (int) floor(lon0), n;
+
+    if (dlon > 180) { dlon -= 360; } else if (dlon < -180) { dlon += 360; }	/* Crosses the antimeridian */
+
+    /* next_lat and next_lon are proportions of the line, so 2 is never */
+    n = abs((int) floor(lat0 + dlat) - south) + abs((int) floor(lon0 + dlon) - west);
+    step_lat = dlat ? fabs(1/dlat) : 0;
+    step_lon = dlon ? fabs(1/dlon) : 0;
+    next_lat = dlat ? (dlat > 0 ? south + 1 - lat0 : lat0 - south) * step_lat : 2;
+    next_lon = dlon ? (dlon > 0 ? west + 1 - lon0 : lon0 - west) * step_lon : 2;
+    while (n-- > 0)
+    {
+        if (next_lat < next_lon)
+        {
+            south += dlat > 0 ? 1 : -1;
+            next_lat += step_lat;
+        }
+        else
+        {
+            west += dlon > 0 ? 1 : -1;
+            next_lon += step_lon;
+        }
+        if (!addtotile(route, south, west)) { return 0; }
+    }
+    return 1;
+}
+
+
+/* Add a route to the lists of the tiles that a ship's course from a towards b passes through, apart from a's tile, in n
+ * straight steps */
+static int addcoursetotile(route_t *route, loc_t a, loc_t b, float len, int n)
+{
+    double hdg = (double) headingto(a, b);
+    loc_t prev = a, next;
+    int j;
+
+    for (j=1; j<=n; j++)
+    {
+        next = coursestep(a, hdg, len, j, n);
+        if (!addlinetotile(route, prev, next)) { return 0; }
+        prev = next;
+    }
+    return 1;
+}
+
+
+/* Add a route to the lists of all the tiles that its segments pass through, not just those that hold its nodes, so
+ * that a long open-water segment is found when the plane is near its middle. On long segments at high latitudes the
+ * courses that ships follow can be several tiles away from the straight line in lat/lon, so segments longer than
+ * GREAT_CIRCLE_STEP are followed in steps along the courses in both directions.
+ * Also measures the route's length. */
 static int addroutetotile(route_t *route)
 {
     int i;
-    for (i=0; i<route->pathlen; i++)
+
+    route->length = 0;
+    if (!addtotile(route, (int) floor(route->path[0].lat), (int) floor(route->path[0].lon))) { return 0; }
+    for (i=1; i<route->pathlen; i++)
     {
-        route_list_t **route_list;
-        int south, west;
-        south=(int)floor(route->path[i].lat);
-        west=(int)floor(route->path[i].lon);
-        route_list=&routes[south+90][west+180];
+        loc_t a = route->path[i-1], b = route->path[i];
+        float len = distanceto(a, b);
+        int n = (int) ceilf(len / GREAT_CIRCLE_STEP);
 
-        if (!*route_list || (*route_list)->route!=route)	/* We add from front so only need to check first route */
+        route->length += len;
+        if (n <= 1)
         {
-            if (!route_list_add(route_list, route)) { return 0; }
+            if (!addlinetotile(route, a, b)) { return 0; }
         }
+        else if (!addcoursetotile(route, a, b, len, n) ||
+                 !addtotile(route, (int) floor(b.lat), (int) floor(b.lon)) ||	/* course needn't end in b's tile */
+                 !addcoursetotile(route, b, a, len, n))
+        {
+            return 0;
+        }
+    }
+    if (route_n >= all_routes_max)
+    {
+        route_t **new_routes;
+        all_routes_max = all_routes_max ? 2*all_routes_max : 1024;
+        if (!(new_routes = realloc(all_routes, all_routes_max * sizeof(route_t *)))) { return 0; }
+        all_routes = new_routes;
     }
+    all_routes[route_n++] = route;
     return 1;
 }
 
@@ -159,15 +395,482 @@ route_list_t *getroutesbytile(int south, int west)
 }
 
 
+/* Number of routes in all the tiles in the superblock containing this tile. Zero means the whole superblock can be skipped. */
+int getroutecountbyblock(int south, int west)
+{
+    return block_n[(south+90)/SUPERBLOCK][(west+180)/SUPERBLOCK];
+}
+
+
+/* Reset all routes' marks, for when recalc()'s mark wraps round */
+void routes_clearmarks(void)
+{
+    int i, j;
+    route_list_t *route_list;
+
+    for (i=0; i<180; i++)
+        for (j=0; j<360; j++)
+            for (route_list=routes[i][j]; route_list; route_list=route_list->next)
+                route_list->route->mark=0;
+}
+
+
+/**********************************************************************
+ Path interning
+ **********************************************************************/
+
+/* Point hash table entry, for finding junctions */
+typedef struct
+{
+    loc_t loc;
+    int route;		/* Index+1 of the last route seen to use this point, or 0 if the entry is empty */
+    int count;		/* Number of routes that use this point */
+} point_entry_t;
+
+static inline unsigned int pointhash(loc_t loc)
+{
+    unsigned int lat, lon;
+    memcpy(&lat, &loc.lat, sizeof(lat));
+    memcpy(&lon, &loc.lon, sizeof(lon));
+    return (lat * 0x9e3779b1u) ^ (lon * 0x85ebca77u) ^ (lon >> 15);
+}
+
+static inline int pointequal(loc_t a, loc_t b)
+{
+    return !memcmp(&a, &b, sizeof(loc_t));	/* bitwise, so that a NaN can't make the hash lookups spin */
+}
+
+static inline int pointless(loc_t a, loc_t b)
+{
+    return (a.lat < b.lat) || ((a.lat == b.lat) && (a.lon < b.lon));
+}
+
+
+/* Number of routes that use a point. The point must be in the table. */
+static int pointcount(point_entry_t *points, unsigned int mask, loc_t loc)
+{
+    unsigned int h;
+    for (h = pointhash(loc) & mask; !pointequal(points[h].loc, loc); h = (h+1) & mask);
+    return points[h].count;
+}
+
+
+/* Zigzag varint encoding - small deltas of either sign take few bytes */
+static inline unsigned char *putvarint(unsigned char *p, int v)
+{
+    unsigned int u = v < 0 ? ~((unsigned int) v << 1) : (unsigned int) v << 1;
+    while (u >= 0x80)
+    {
+        *(p++) = (unsigned char) (u | 0x80);
+        u >>= 7;
+    }
+    *(p++) = (unsigned char) u;
+    return p;
+}
+
+static inline const unsigned char *getvarint(const unsigned char *p, int *v)
+{
+    unsigned int u = 0;
+    int shift = 0;
+    do
+    {
+        u |= (unsigned int) (*p & 0x7f) << shift;
+        shift += 7;
+    } while (*(p++) & 0x80);
+    *v = (int) (u >> 1) ^ -(int) (u & 1);
+    return p;
+}
+
+static inline int quantize(float f)
+{
+    return (int) floor((double) f / PATH_QUANTUM + 0.5);
+}
+
+
+/* Encode points from path[0] to path[len-1], or in reverse, into buf. Returns the number of bytes used (at most 10 per point). */
+static int encodepoints(const loc_t *path, int len, int reversed, unsigned char *buf)
+{
+    unsigned char *p = buf;
+    int i, lat = 0, lon = 0;
+    for (i=0; i<len; i++)
+    {
+        const loc_t *loc = path + (reversed ? len-1-i : i);
+        int qlat = quantize(loc->lat), qlon = quantize(loc->lon);
+        p = putvarint(p, qlat - lat);
+        p = putvarint(p, qlon - lon);
+        lat = qlat;
+        lon = qlon;
+    }
+    return p - buf;
+}
+
+
+/* Decode a segment into out[0] to out[len-1], or in reverse */
+static void decodesegment(int ref, loc_t *out)
+{
+    const segment_t *seg = segments + (ref >> 1);
+    const unsigned char *p = seg_bytes + seg->first;
+    int i, d, lat = 0, lon = 0;
+    for (i=0; i<seg->len; i++)
+    {
+        loc_t *loc = out + ((ref & 1) ? seg->len-1-i : i);
+        p = getvarint(p, &d); lat += d;
+        p = getvarint(p, &d); lon += d;
+        loc->lat = (float) (lat * PATH_QUANTUM);
+        loc->lon = (float) (lon * PATH_QUANTUM);
+    }
+}
+
+
+/* Decode a route's path into out, which must have room for pathlen points */
+static void decodepath(const route_t *route, loc_t *out)
+{
+    int i, n = 0;
+    for (i=0; i<route->seg_n; i++)
+    {
+        if (i) { n--; }		/* segments share their end points */
+        decodesegment(route->segs[i], out + n);
+        n += segments[route->segs[i] >> 1].len;
+    }
+    assert(n == route->pathlen);
+}
+
+
+/* Find or add a route's path points from path[0] to path[len-1] as a segment. buf must have room for len encoded points.
+ * Returns the segment reference, or -1 on alloc failure. */
+static int internsegment(const loc_t *path, int len, int *table, unsigned int mask, unsigned char *buf)
+{
+    unsigned int hash = 2166136261u;
+    int i, n, reversed = 0;
+    segment_t *seg;
+
+    /* Canonical direction is whichever is lexicographically smaller */
+    for (i=0; i<len; i++)
+        if (!pointequal(path[i], path[len-1-i]))
+        {
+            reversed = pointless(path[len-1-i], path[i]);
+            break;
+        }
+    n = encodepoints(path, len, reversed, buf);
+    for (i=0; i<n; i++)
+        hash = (hash ^ buf[i]) * 16777619u;
+
+    for (hash &= mask; table[hash]; hash = (hash+1) & mask)
+    {
+        int id = table[hash]-1;
+        int bytes = (id+1 < segment_n ? segments[id+1].first : seg_bytes_n) - segments[id].first;
+        if (segments[id].len == len && bytes == n && !memcmp(seg_bytes + segments[id].first, buf, n))
+            return (id << 1) | reversed;
+    }
+
+    /* New segment */
+    if (segment_n >= segment_max)
+    {
+        segment_t *new_segments;
+        int new_max = segment_max ? 2*segment_max : 1024;
+        if (!(new_segments = realloc(segments, new_max * sizeof(segment_t)))) { return -1; }
+        mem_add(mem_paths, !segment_max, (new_max-segment_max) * sizeof(segment_t));
+        segments = new_segments;
+        segment_max = new_max;
+    }
+    if (seg_bytes_n + n > seg_bytes_max)
+    {
+        unsigned char *new_bytes;
+        int new_max = seg_bytes_max ? 2*seg_bytes_max : 65536;
+        while (new_max < seg_bytes_n + n) { new_max *= 2; }
+        if (!(new_bytes = realloc(seg_bytes, new_max))) { return -1; }
+        mem_add(mem_paths, !seg_bytes_max, new_max-seg_bytes_max);
+        seg_bytes = new_bytes;
+        seg_bytes_max = new_max;
+    }
+    seg = segments + segment_n;
+    seg->first = seg_bytes_n;
+    seg->len = len;
+    memcpy(seg_bytes + seg_bytes_n, buf, n);
+    seg_bytes_n += n;
+    seg_pts_n += len;
+    table[hash] = ++segment_n;
+    return ((segment_n-1) << 1) | reversed;
+}
+
+
+/* Replace each route's path with a list of shared segments. Runs on the loader thread once all routes are read. */
+static int internroutes(char *err)
+{
+    point_entry_t *points = NULL;
+    int *table = NULL;
+    unsigned char *buf = NULL;
+    unsigned int size, mask, h;
+    int i, j, nodes = 0, maxlen = 0;
+
+    for (i=0; i<route_n; i++)
+    {
+        nodes += all_routes[i]->pathlen;
+        if (all_routes[i]->pathlen > maxlen) { maxlen = all_routes[i]->pathlen; }
+    }
+    for (size=1024; size < 2*(unsigned int) nodes; size *= 2);
+    mask = size-1;
+    if (!(points = calloc(size, sizeof(point_entry_t))) || !(table = calloc(size, sizeof(int))) || !(buf = malloc(maxlen * 10)))
+    {
+        free(points);
+        free(table);
+        free(buf);
+        strcpy(err, "Out of memory");
+        return 0;
+    }
+
+    /* Count the routes that use each point */
+    for (i=0; i<route_n; i++)
+    {
+        route_t *route = all_routes[i];
+        for (j=0; j<route->pathlen; j++)
+        {
+            for (h = pointhash(route->path[j]) & mask; points[h].route && !pointequal(points[h].loc, route->path[j]); h = (h+1) & mask);
+            if (!points[h].route) { points[h].loc = route->path[j]; }
+            if (points[h].route != i+1)
+            {
+                points[h].route = i+1;
+                points[h].count++;
+            }
+        }
+    }
+
+    /* Split paths at junctions, and intern the pieces */
+    for (i=0; i<route_n; i++)
+    {
+        route_t *route = all_routes[i];
+        int start = 0, n = 0, *refs;
+
+        if (!(refs = malloc(route->pathlen * sizeof(int)))) { break; }	/* enough for the worst case */
+        if (route->pathlen == 1)
+        {
+            n = (refs[0] = internsegment(route->path, 1, table, mask, buf)) < 0 ? -1 : 1;
+        }
+        for (j=1; j<route->pathlen && n>=0; j++)
+        {
+            if (j < route->pathlen-1)
+            {
+                /* Split where a run of nodes shared with other routes starts or ends */
+                int count = pointcount(points, mask, route->path[j]);
+                if (count < 2 ||
+                    (count == pointcount(points, mask, route->path[j-1]) && count == pointcount(points, mask, route->path[j+1])))
+                    continue;
+            }
+            if ((refs[n] = internsegment(route->path + start, j-start+1, table, mask, buf)) < 0) { n = -1; }
+            else { n++; start = j; }
+        }
+        if (n < 0)
+        {
+            free(refs);
+            break;
+        }
+        route->segs = refs;
+        if ((refs = realloc(refs, n * sizeof(int)))) { route->segs = refs; }	/* shrink */
+        route->seg_n = n;
+        mem_add(mem_paths, 0, n * sizeof(int) - route->pathlen * sizeof(loc_t));	/* allocation count unchanged: path for segs */
+        intern_refs += n;
+    }
+
+    for (j=0; j<route_n; j++)
+    {
+        free(all_routes[j]->path);
+        all_routes[j]->path = NULL;
+    }
+    free(points);
+    free(table);
+    free(buf);
+    free(all_routes);
+    all_routes = NULL;
+    intern_nodes = nodes;
+    if (i < route_n)
+    {
+        strcpy(err, "Out of memory");
+        return 0;
+    }
+    return 1;
+}
+
+
+/* Log how much interning saved */
+void routes_summary(void)
+{
+    char buf[200];
+
+    sprintf(buf, "SeaTraffic: Interned %d route nodes as %d segments with %d nodes, referenced %d times\n", intern_nodes, segment_n, seg_pts_n, intern_refs);
+    XPLMDebugString(buf);
+    sprintf(buf, "SeaTraffic: Paths take %d bytes, %.2f bytes/node (%d bytes as floats)\n", seg_bytes_n, seg_pts_n ? (double) seg_bytes_n / seg_pts_n : 0.0, intern_nodes * (int) sizeof(loc_t));
+    XPLMDebugString(buf);
+}
+
+
+/* Call fn on each segment between consecutive nodes of a route's path until it returns non-zero, without decoding
+ * the whole path. Returns fn's result. */
+int route_anysegment(route_t *route, int (*fn)(loc_t, loc_t))
+{
+    int i, j, d, lat, lon;
+    loc_t loc, prev;
+
+    for (i=0; i<route->seg_n; i++)
+    {
+        const segment_t *seg = segments + (route->segs[i] >> 1);
+        const unsigned char *p = seg_bytes + seg->first;
+        lat = lon = 0;
+        for (j=0; j<seg->len; j++)	/* order doesn't matter here, so ignore reversal */
+        {
+            p = getvarint(p, &d); lat += d;
+            p = getvarint(p, &d); lon += d;
+            loc.lat = (float) (lat * PATH_QUANTUM);
+            loc.lon = (float) (lon * PATH_QUANTUM);
+            if (j && fn(prev, loc)) { return 1; }
+            prev = loc;
+        }
+    }
+    return 0;
+}
+
+
+/* Decode a route's path into route->path, for as long as it's in use. Returns NULL on alloc failure. */
+loc_t *route_acquire(route_t *route)
+{
+    if (route->path_users++) { return route->path; }
+    if (!(route->path = malloc(route->pathlen * sizeof(loc_t))))
+    {
+        route->path_users--;
+        return NULL;
+    }
+    mem_add(mem_paths, 1, route->pathlen * sizeof(loc_t));
+    decodepath(route, route->path);
+    return route->path;
+}
+
+
+void route_release(route_t *route)
+{
+    assert(route->path_users > 0);
+    if (--route->path_users) { return; }
+    free(route->path);
+    route->path = NULL;
+    mem_add(mem_paths, -1, -(int) (route->pathlen * sizeof(loc_t)));
+}
+
+
+#if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
+
+/**********************************************************************
+ Route names
+ **********************************************************************/
+
+/* Find or add a name in the pool. Returns offset+1, or 0 on alloc failure. */
+static int internname(const char *name)
+{
+    unsigned int hash = 2166136261u, h;
+    const unsigned char *c;
+    int i, len = strlen(name);
+
+    if (2*(name_n+1) > name_table_size)
+    {
+        /* Grow and rehash */
+        int new_size = name_table_size ? 2*name_table_size : 1024;
+        int *new_table;
+        if (!(new_table = calloc(new_size, sizeof(int)))) { return 0; }
+        mem_add(mem_names, !name_table_size, (new_size-name_table_size) * sizeof(int));
+        for (i=0; i<name_table_size; i++)
+            if (name_table[i])
+            {
+                unsigned int rehash = 2166136261u;
+                for (c = (const unsigned char *) name_pool + name_table[i]-1; *c; c++) { rehash = (rehash ^ *c) * 16777619u; }
+                for (h = rehash & (new_size-1); new_table[h]; h = (h+1) & (new_size-1));
+                new_table[h] = name_table[i];
+            }
+        free(name_table);
+        name_table = new_table;
+        name_table_size = new_size;
+    }
+
+    for (c = (const unsigned char *) name; *c; c++) { hash = (hash ^ *c) * 16777619u; }
+    for (h = hash & (name_table_size-1); name_table[h]; h = (h+1) & (name_table_size-1))
+        if (!strcmp(name_pool + name_table[h]-1, name)) { return name_table[h]; }
+
+    if (name_pool_n + len + 1 > name_pool_max)
+    {
+        char *new_pool;
+        int new_max = name_pool_max ? 2*name_pool_max : 16384;
+        while (new_max < name_pool_n + len + 1) { new_max *= 2; }
+        if (!(new_pool = realloc(name_pool, new_max))) { return 0; }
+        mem_add(mem_names, !name_pool_max, new_max-name_pool_max);
+        name_pool = new_pool;
+        name_pool_max = new_max;
+    }
+    strcpy(name_pool + name_pool_n, name);
+    name_table[h] = name_pool_n+1;
+    name_pool_n += len+1;
+    name_n++;
+    return name_table[h];
+}
+
+
+/* Read a route's name from routes.txt, if it hasn't been already. This is disk I/O, so callers should do it when a ship
+ * starts rather than when it's drawn. Returns 0 on failure. */
+int route_loadname(route_t *route)
+{
+    char buffer[PATH_MAX], *c;
+
+    if (route->name_idx) { return 1; }
+    if (!name_h)
+    {
+        strcpy(buffer, loader_path);
+        strcat(buffer, "routes.txt");
+        if (!(name_h=fopen(buffer, "r"))) { return 0; }
+    }
+    if (fseek(name_h, route->name_pos, SEEK_SET) || !(c=fgets(buffer, PATH_MAX, name_h))) { return 0; }
+    if (!strncmp(c, "\xef\xbb\xbf", 3)) { c+=3; }	/* skip Unicode BOM */
+    while (isspace(*c)) { c++; }	/* ltrim */
+    return (route->name_idx = internname(splitheader(c))) != 0;
+}
+
+
+/* A route's name if route_loadname() has read it, else "". The result is only valid until names are next read. */
+const char *route_name(const route_t *route)
+{
+    return route->name_idx ? name_pool + route->name_idx-1 : "";
+}
+
+
+/* Forget all route names, e.g. when the local map is turned off */
+void routes_freenames(void)
+{
+    int i, j;
+    route_list_t *route_list;
+
+    if (!name_pool && !name_h) { return; }
+    for (i=0; i<180; i++)
+        for (j=0; j<360; j++)
+            for (route_list=routes[i][j]; route_list; route_list=route_list->next)
+                route_list->route->name_idx=0;
+    if (name_pool) { mem_add(mem_names, -1, -name_pool_max); }
+    if (name_table) { mem_add(mem_names, -1, -(int) (name_table_size * sizeof(int))); }
+    free(name_pool);
+    free(name_table);
+    name_pool = NULL;
+    name_table = NULL;
+    name_pool_n = name_pool_max = name_table_size = name_n = 0;
+    if (name_h) { fclose(name_h); }
+    name_h = NULL;
+}
+
+#endif	/* DO_LOCAL_MAP || DO_ACTIVE_LIST */
+
+
 /**********************************************************************
  Linked list manipulation
  **********************************************************************/
 
 /* Allocates and adds to front of list */
-route_list_t *route_list_add(route_list_t **route_list, route_t *route)
+route_list_t *route_list_add(route_list_t **route_list, route_t *route, mem_kind_t kind)
 {
     route_list_t *newroute;
     if (!(newroute=malloc(sizeof(route_list_t)))) { return 0; }
+    mem_add(kind, 1, sizeof(route_list_t));
     newroute->route=route;
     newroute->next=*route_list;
     *route_list=newroute;
@@ -187,7 +890,7 @@ route_list_t *route_list_get_byroute(route_list_t *route_list, route_t *route)
 
 
 /* Return nth item in list. Assumes that there are n items in list */
-route_t *route_list_pop(route_list_t **route_list, int n)
+route_t *route_list_pop(route_list_t **route_list, int n, mem_kind_t kind)
 {
     route_t *route;
     route_list_t *this, **lastptr=route_list;
@@ -200,6 +903,7 @@ route_t *route_list_pop(route_list_t **route_list, int n)
     route=this->route;
     *lastptr=this->next;
     free(this);
+    mem_add(kind, -1, -(int) sizeof(route_list_t));
     return route;
 }
 
@@ -217,26 +921,54 @@ int route_list_length(route_list_t *route_list)
 
 
 /* Free entire list */
-void route_list_free(route_list_t **route_list)
+void route_list_free(route_list_t **route_list, mem_kind_t kind)
 {
     route_list_t *next;
     while (*route_list)
     {
         next=(*route_list)->next;
         free(*route_list);
+        mem_add(kind, -1, -(int) sizeof(route_list_t));
         *route_list=next;
     }
 }
 
 
-/* Allocates and adds to front of list */
-active_route_t *active_route_add(active_route_t **active_routes)
+/* Last route in the active list with each model id - a bucket per model, so that adding a route doesn't search the
+ * list. There's only one active list. */
+static active_route_t **model_tails = NULL;
+static int model_tails_max = 0;
+
+
+/* Adds to list after the last route with the same model, or to the front if there isn't one, so that routes that draw
+ * the same object are adjacent and texture swaps are minimised when drawing. Removal preserves the grouping. */
+void active_route_add(active_route_t **active_routes, active_route_t *newroute)
 {
-    active_route_t *newroute;
-    if (!(newroute=malloc(sizeof(active_route_t)))) { return NULL; }
+    int id = newroute->model_id;
+
+    assert(id >= 0);
+    if (id >= model_tails_max)
+    {
+        /* models.c hands out new ids as objects are loaded */
+        active_route_t **new_tails;
+        int new_max = model_tails_max ? 2*model_tails_max : 64;
+        while (new_max <= id) { new_max *= 2; }
+        if ((new_tails = realloc(model_tails, new_max * sizeof(active_route_t *))))
+        {
+            memset(new_tails + model_tails_max, 0, (new_max-model_tails_max) * sizeof(active_route_t *));
+            mem_add(mem_active, model_tails_max ? 0 : 1, (new_max-model_tails_max) * (int) sizeof(active_route_t *));
+            model_tails = new_tails;
+            model_tails_max = new_max;
+        }
+    }
+    if (id < model_tails_max)
+    {
+        if (model_tails[id]) { active_routes=&(model_tails[id]->next); }
+        model_tails[id]=newroute;
+    }
+    /* else alloc failure - just add to the front, ungrouped */
     newroute->next=*active_routes;
     *active_routes=newroute;
-    return *active_routes;
 }
 
 
@@ -264,15 +996,19 @@ active_route_t *active_route_get_byroute(active_route_t *active_routes, route_t
 
 void active_route_pop(active_route_t **active_routes, int n)
 {
-    active_route_t *this, **lastptr=active_routes;
+    active_route_t *this, *prev=NULL, **lastptr=active_routes;
     while (n--)
     {
-        lastptr=&((*lastptr)->next);
+        prev=*lastptr;
+        lastptr=&(prev->next);
         assert(*lastptr!=NULL);
     }
     this=*lastptr;
     *lastptr=this->next;
+    if (this->model_id < model_tails_max && model_tails[this->model_id]==this)
+        model_tails[this->model_id] = (prev && prev->model_id==this->model_id) ? prev : NULL;
     free(this);
+    mem_add(mem_active, -1, -(int) sizeof(active_route_t));
 }
 
 
@@ -288,28 +1024,93 @@ int active_route_length(active_route_t *active_routes)
 }
 
 
-/* Callback for active_route_sort */
-static int sortactive(const void *a, const void *b)
+/**********************************************************************
+ Event queue - binary min-heap of active routes keyed on next_time
+ **********************************************************************/
+
+static active_route_t **events = NULL;
+static int event_n = 0, event_max = 0;
+
+
+static void event_set(int i, active_route_t *a)
+{
+    events[i]=a;
+    a->heap_idx=i;
+}
+
+
+static void event_siftup(int i)
 {
-    const active_route_t *const *ra = a, *const *rb = b;
-    return strcmp((*ra)->object_name, (*rb)->object_name);
+    active_route_t *a=events[i];
+    while (i)
+    {
+        int parent=(i-1)/2;
+        if (events[parent]->next_time <= a->next_time) { break; }
+        event_set(i, events[parent]);
+        i=parent;
+    }
+    event_set(i, a);
 }
 
 
-/* Sort active routes by object name to minimise texture swaps when drawing.
- * Rather than actually shuffling the routes around in memory we just sort an array of pointers and then go back
- * and fix up the linked list. */
-void active_route_sort(active_route_t **active_routes, int active_n)
+static void event_siftdown(int i)
 {
-    int i;
-    active_route_t *table[ACTIVE_MAX], *active_route;
+    active_route_t *a=events[i];
+    int child;
+    while ((child=2*i+1) < event_n)
+    {
+        if (child+1 < event_n && events[child+1]->next_time < events[child]->next_time) { child++; }
+        if (a->next_time <= events[child]->next_time) { break; }
+        event_set(i, events[child]);
+        i=child;
+    }
+    event_set(i, a);
+}
+
+
+/* Queue an active route on its next_time. Returns 0 on alloc failure. */
+int event_add(active_route_t *a)
+{
+    if (event_n >= event_max)
+    {
+        int new_max = event_max ? 2*event_max : 64;
+        active_route_t **new_events;
+        if (!(new_events=realloc(events, new_max * sizeof(active_route_t *)))) { return 0; }
+        mem_add(mem_active, event_max ? 0 : 1, (new_max-event_max) * (int) sizeof(active_route_t *));
+        events=new_events;
+        event_max=new_max;
+    }
+    events[event_n]=a;
+    event_siftup(event_n++);
+    return -1;
+}
+
+
+void event_remove(active_route_t *a)
+{
+    int i=a->heap_idx;
+    assert(i>=0 && i<event_n && events[i]==a);
+    if (i != --event_n)
+    {
+        active_route_t *moved=events[event_n];	/* Fill the hole with the last event */
+        events[i]=moved;
+        event_siftup(i);
+        event_siftdown(moved->heap_idx);
+    }
+    a->heap_idx=-1;
+}
 
-    if (active_n <= 2) return;		/* Nothing useful to do */
 
-    for (i = 0, active_route = *active_routes; active_route; active_route = active_route->next)
-        table[i++] = active_route;
-    qsort(table, active_n, sizeof(active_route), sortactive);
-    *active_routes = table[0];
-    for (i = 0; i < active_n; i++)
-        table[i]->next = i < active_n-1 ? table[i+1] : NULL;
+/* Re-position an active route after its next_time has changed */
+void event_update(active_route_t *a)
+{
+    event_siftup(a->heap_idx);
+    event_siftdown(a->heap_idx);
+}
+
+
+/* The active route with the earliest next_time, if that is due by now */
+active_route_t *event_due(float now)
+{
+    return (event_n && events[0]->next_time <= now) ? events[0] : NULL;
 }
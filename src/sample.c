@@ -0,0 +1,143 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ */
+
+#include "seatraffic.h"
+
+/* Random numbers, and weighted sampling of candidate routes.
+ *
+ * The plugin has its own generator rather than using libc's rand(), so that its choices don't depend on what other
+ * plugins do with the shared rand() state and can be reproduced from the seed stored in a recording.
+ * The generator is xoshiro128** - http://xoshiro.di.unimi.it/ */
+
+static unsigned int rng_state[4];
+
+
+static inline unsigned int rotl(unsigned int x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+/* Seed the generator. The state is filled using splitmix32 so that similar seeds give unrelated sequences. */
+void rng_seed(unsigned int seed)
+{
+    int i;
+    for (i=0; i<4; i++)
+    {
+        unsigned int z = (seed += 0x9e3779b9);
+        z = (z ^ (z >> 16)) * 0x85ebca6b;
+        z = (z ^ (z >> 13)) * 0xc2b2ae35;
+        rng_state[i] = z ^ (z >> 16);
+    }
+    if (!(rng_state[0] | rng_state[1] | rng_state[2] | rng_state[3])) { rng_state[0] = 1; }	/* all zero is a fixed point */
+}
+
+unsigned int rng_next(void)
+{
+    unsigned int result = rotl(rng_state[1] * 5, 7) * 9;
+    unsigned int t = rng_state[1] << 9;
+    rng_state[2] ^= rng_state[0];
+    rng_state[3] ^= rng_state[1];
+    rng_state[1] ^= rng_state[2];
+    rng_state[0] ^= rng_state[3];
+    rng_state[2] ^= t;
+    rng_state[3] = rotl(rng_state[3], 11);
+    return result;
+}
+
+/* Uniform in [0,n), without the bias of rng_next() % n */
+int rng_below(int n)
+{
+    unsigned int r, threshold = (0u - (unsigned int) n) % (unsigned int) n;	/* 2^32 % n */
+    assert(n > 0);
+    do { r = rng_next(); } while (r < threshold);
+    return (int) (r % (unsigned int) n);
+}
+
+/* Uniform in [0,1) */
+float rng_float(void)
+{
+    return (rng_next() >> 8) * (1.f / 16777216);
+}
+
+
+/**********************************************************************
+ Weighted sampling using Vose's alias method -
+ http://www.keithschwarz.com/darts-dice-coins/
+ **********************************************************************/
+
+static float *prob = NULL;	/* Chance of keeping each column's own index rather than its alias */
+static int *alias = NULL;
+static int *work = NULL;	/* Stacks of small and large columns while building */
+static int sample_n = 0, sample_max = 0;
+
+
+/* Build the alias table for weights[0] to weights[n-1] in O(n). Returns 0 on alloc failure. */
+int sample_build(const float *weights, int n)
+{
+    double total = 0;
+    int i, small = 0, large = n;	/* small stack grows up from 0, large stack grows down from n */
+
+    sample_n = 0;
+    if (n > sample_max)
+    {
+        float *new_prob;
+        int *new_alias, *new_work, new_max = sample_max ? sample_max : 256;
+        while (new_max < n) { new_max *= 2; }
+        if (!(new_prob = realloc(prob, new_max * sizeof(float)))) { return 0; }
+        prob = new_prob;
+        if (!(new_alias = realloc(alias, new_max * sizeof(int)))) { return 0; }
+        alias = new_alias;
+        if (!(new_work = realloc(work, new_max * sizeof(int)))) { return 0; }
+        work = new_work;
+        mem_add(mem_candidates, sample_max ? 0 : 3, (new_max - sample_max) * (int) (sizeof(float) + 2*sizeof(int)));
+        sample_max = new_max;
+    }
+
+    for (i=0; i<n; i++)
+        total += (double) weights[i];
+    if (total <= 0) { return -1; }	/* Nothing to pick */
+
+    /* Scale so that the average column is 1, and sort into those that are under-full and over-full */
+    for (i=0; i<n; i++)
+    {
+        prob[i] = (float) ((double) weights[i] * n / total);
+        alias[i] = i;
+        if (prob[i] < 1)
+            work[small++] = i;
+        else
+            work[--large] = i;
+    }
+
+    /* Fill each under-full column from an over-full one */
+    while (small && large < n)
+    {
+        int s = work[--small], l = work[large++];
+        alias[s] = l;
+        prob[l] = (prob[l] + prob[s]) - 1;
+        if (prob[l] < 1)
+            work[small++] = l;
+        else
+            work[--large] = l;
+    }
+
+    /* Anything left over is full, give or take rounding */
+    while (small) { prob[work[--small]] = 1; }
+    while (large < n) { prob[work[large++]] = 1; }
+
+    sample_n = n;
+    return -1;
+}
+
+
+/* Pick an index with probability proportional to its weight in O(1), or -1 if there's nothing to pick */
+int sample_pick(void)
+{
+    int i;
+    if (!sample_n) { return -1; }
+    i = rng_below(sample_n);
+    return rng_float() < prob[i] ? i : alias[i];
+}
@@ -20,50 +20,158 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD ul_reason, LPVOID lpReserved)
 /* Globals */
 static char mypath[PATH_MAX], *relpath;
 
-/* Ship types. Order must match ship_kind_t enum */
-const ship_t ships[ship_kind_count] =
-{
-    /* speed [m/s], semilen [m], token */
-    {  2,  8, "leisure" },	/*  ~4   knots */
-    {  3, 15, "tourist" },	/*  ~6   knots */
-    { 12, 80, "cruise"  },	/* ~23.5 knots */
-    { 11, 11, "ped/sml" },	/* ~21.5 knots */
-    { 16, 21, "ped/med" },	/* ~31   knots */
-    {  5, 11, "veh/sml" },	/*  ~9.5 knots */
-    {  6, 30, "veh/med" },	/* ~11.5 knots */
-    { 10, 76, "veh/big" },	/* ~19.5 knots */
-    {  8, 95, "cargo"   },	/* ~15.5 knots */
-    {  8,125, "tanker"  },	/* ~15.5 knots */
-};
-
 
 static XPLMDataRef ref_view_x, ref_view_y, ref_view_z, ref_view_h;
-static XPLMDataRef ref_plane_lat, ref_plane_lon, ref_night, ref_monotonic, ref_renopt=0, ref_rentype;
+static XPLMDataRef ref_plane_lat, ref_plane_lon, ref_plane_gs, ref_plane_track, ref_night, ref_monotonic, ref_renopt=0, ref_rentype;
+static XPLMDataRef ref_budget, ref_active_max, ref_frame_cost;
 static XPLMObjectRef wake_big_ref, wake_med_ref, wake_sml_ref;
 static float last_frame=0;		/* last time we recalculated */
+static float next_hdg_update=0, next_budget_update=0;
+static sim_input_t input;		/* Simulator state for this draw callback */
 static int done_init=0, need_recalc=1;
+static int routes_ready=0;			/* 0 while routes.txt is being read in the background, -1 if that failed */
+static double start_time;			/* When XPluginStart was called [us] */
 static tile_t current_tile={0,0};
+static int render_radius = RENDER_RADIUS;	/* Simulate ships within this distance of the plane [m] */
+static loc_t range_centre={0,0};		/* Plane's location at the last recalc, which render_radius is measured from */
+static float range_coslat=1;			/* cos(range_centre.lat), for the longitude scale */
+static unsigned short recalc_mark=0;		/* Marks routes that have been considered in this recalc */
+static route_t **hood=NULL;			/* Candidate routes around range_centre, */
+static float *hood_weights=NULL;		/* and their weights */
+static int hood_n=0, hood_max=0;
+static int hood_valid=0, hood_radius=0;		/* Whether the candidates are up to date, and the render_radius they're for */
+static float kind_weights[ship_kind_count] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };	/* Relative chance of picking each kind of ship */
+static float length_exponent=0;			/* and each route, by its length [km] raised to this power */
+static XPLMDataRef ref_kind_weights, ref_length_exponent;
+static const int tier_interval[tier_count] = { 1, TIER_MID_INTERVAL, TIER_FAR_INTERVAL };	/* Frames between updates */
+static const char *tier_names[tier_count] = { "near", "mid", "far" };
+static int tier_n[tier_count];			/* Number of ships in each tier in the last frame */
+static XPLMDataRef tier_refs[tier_count];
+static unsigned int update_frame=0;		/* Frame counter for scheduling updates */
+static unsigned char next_tick_phase=0;		/* Staggers the updates of new ships */
+static int origin_valid=0;
+static dloc_t origin_ref;			/* A location used to detect shifts of X-Plane's local co-ordinate system */
+static double origin_x, origin_z;		/* and its local co-ordinates */
+static XPLMDataRef ref_render_radius;
 static int active_n=0;
-static int active_max = ACTIVE_DEFAULT;
+static int active_max = ACTIVE_DEFAULT;		/* Current limit on number of active routes */
+static int active_base = ACTIVE_DEFAULT;	/* Limit implied by rendering options */
+static int frame_budget = FRAME_BUDGET;		/* Target for our own per-frame cost, or 0 to just use active_base [us] */
+static double frame_cost=0, frame_cost_avg=0;	/* Time spent drawing ships in this frame, and smoothed over frames [us] */
 static active_route_t *active_routes = NULL;
 static XPLMMenuID my_menu_id;
 static int do_wakes=0;
+static int do_trace=0;
+static int do_record=0, do_replay=0;
+static int do_export=0;
+static unsigned int next_ship_id=1;	/* Identifies ships to external tools */
 #ifdef DO_LOCAL_MAP
 static int do_local_map=0;
+static map_tile_t map_tiles[(2*TILE_RANGE+1)*(2*TILE_RANGE+1)];	/* Cached route polylines for the local map */
+static double map_origin[3];		/* Local co-ordinates of the current tile's SW corner when the cache was built */
 #endif
 #ifdef DO_ACTIVE_LIST
 static XPLMWindowID windowId = NULL;
-static int drawtime, drawmax;		/* clock time taken in last main loop [us] */
-# if IBM
-static __int64 ticks_per_sec;
-# endif
 #endif
 
 
-static inline int inrange(tile_t tile, loc_t loc)
+/* Position relative to range_centre. Flat-earth approximation is good enough at the scale of render_radius [m] */
+static inline void rangexy(loc_t loc, float *x, float *y)
+{
+    float dlon = loc.lon - range_centre.lon;
+    if (dlon > 180) { dlon -= 360; } else if (dlon < -180) { dlon += 360; }
+    *x = dlon * DEG_LENGTH * range_coslat;
+    *y = (loc.lat - range_centre.lat) * DEG_LENGTH;
+}
+
+/* Square of distance from range_centre [m^2] */
+static inline float rangedistance2(loc_t loc)
+{
+    float x, y;
+    rangexy(loc, &x, &y);
+    return x*x + y*y;
+}
+
+static inline int inrange(loc_t loc)
+{
+    return (rangedistance2(loc) <= (float) render_radius * (float) render_radius);
+}
+
+/* Clip the segment from a to b to the circle of radius around range_centre. Returns 0 if the segment misses it,
+ * otherwise the proportions of the way along the segment that it enters and leaves the circle in t0 and t1. */
+static int segmentclip(loc_t a, loc_t b, float radius, float *t0, float *t1)
+{
+    float ax, ay, bx, by, dx, dy, dd, ad, disc;
+
+    rangexy(a, &ax, &ay);
+    rangexy(b, &bx, &by);
+    dx = bx - ax;
+    dy = by - ay;
+    dd = dx*dx + dy*dy;
+    ad = ax*dx + ay*dy;
+    disc = ad*ad - dd * (ax*ax + ay*ay - radius*radius);
+    if (dd <= 0)
+    {
+        /* Degenerate */
+        *t0 = 0;
+        *t1 = 1;
+        return (ax*ax + ay*ay <= radius*radius);
+    }
+    else if (disc < 0) { return 0; }
+    disc = sqrtf(disc);
+    *t0 = (-ad - disc) / dd;
+    *t1 = (-ad + disc) / dd;
+    if (*t0 < 0) { *t0 = 0; }
+    if (*t1 > 1) { *t1 = 1; }
+    return (*t0 <= *t1);
+}
+
+/* Does the course from a towards b pass within range, in n straight steps */
+static int courseinrange(loc_t a, loc_t b, float len, int n)
+{
+    double hdg = (double) headingto(a, b);
+    loc_t prev = a, next;
+    float t0, t1;
+    int j;
+
+    for (j=1; j<=n; j++)
+    {
+        next = coursestep(a, hdg, len, j, n);
+        if (segmentclip(prev, next, (float) render_radius, &t0, &t1)) { return 1; }
+        prev = next;
+    }
+    return 0;
+}
+
+/* Does the segment from a to b pass within range. Long segments are followed along the courses that ships take in
+ * each direction, like addroutetotile() does, since these can be a long way from the straight line. */
+static int segmentinrange(loc_t a, loc_t b)
+{
+    float t0, t1, len = distanceto(a, b);
+    int n = (int) ceilf(len / GREAT_CIRCLE_STEP);
+
+    if (n <= 1) { return segmentclip(a, b, (float) render_radius, &t0, &t1); }
+    return courseinrange(a, b, len, n) || courseinrange(b, a, len, n);
+}
+
+/* Does any part of the route pass within range */
+static int routeinrange(route_t *route)
 {
-    return ((abs(tile.south - (int) floorf(loc.lat)) <= TILE_RANGE) &&
-            (abs(tile.west  - (int) floorf(loc.lon)) <= TILE_RANGE));
+    return route_anysegment(route, segmentinrange);
+}
+
+/* Extent of render_radius around range_centre in whole tiles, north-south and east-west */
+static void tilerange(int *lat_range, int *lon_range)
+{
+    float extent = render_radius / DEG_LENGTH;
+    *lat_range = (int) ceilf(extent);
+    *lon_range = (int) ceilf(extent / (range_coslat > 0.05f ? range_coslat : 0.05f));
+    if (*lon_range > 180) { *lon_range = 180; }
+}
+
+static inline int intile(int south, int west, loc_t loc)
+{
+    return (((int) floorf(loc.lat) == south) && ((int) floorf(loc.lon) == west));
 }
 
 static inline int indrawrange(float xdist, float ydist)
@@ -81,88 +189,410 @@ static inline int inwakerange(float xdist, float ydist)
     return (xdist*xdist + ydist*ydist <= DRAW_WAKE*DRAW_WAKE);
 }
 
+/* Update rate tier for a ship at this distance from the viewer */
+static inline tier_t tierfor(float xdist, float ydist)
+{
+    float dist2 = xdist*xdist + ydist*ydist;
+    if (dist2 <= TIER_NEAR*TIER_NEAR) { return tier_near; }
+    else if (dist2 <= TIER_MID*TIER_MID) { return tier_mid; }
+    else { return tier_far; }
+}
+
 
-/* Great circle distance, using Haversine formula. http://mathforum.org/library/drmath/view/51879.html */
-static float distanceto(loc_t a, loc_t b)
+/* Ship's current location, or its current node's if that hasn't been calculated yet */
+static inline loc_t shiploc(const active_route_t *a)
 {
-    float slat=sinf((b.lat-a.lat) * (float) (M_PI/360));
-    float slon=sinf((b.lon-a.lon) * (float) (M_PI/360));
-    float aa=slat*slat + cosf(a.lat * (float) (M_PI/180)) * cosf(b.lat * (float) (M_PI/180)) * slon*slon;
-    return RADIUS*2 * atan2f(sqrtf(aa), sqrtf(1-aa));
+    loc_t loc;
+    if (a->new_node)
+    {
+        loc = a->route->path[a->last_node];
+    }
+    else
+    {
+        loc.lat = (float) a->loc.lat;
+        loc.lon = (float) a->loc.lon;
+    }
+    return loc;
 }
 
 
-/* Bearing of b from a [radians] http://mathforum.org/library/drmath/view/55417.html */
-static float headingto(loc_t a, loc_t b)
+/* is this location within distance of the active routes */
+static int tooclose(active_route_t *active_routes, loc_t loc, int distance)
 {
-    float lat1=(a.lat * (float) (M_PI/180));
-    float lon1=(a.lon * (float) (M_PI/180));
-    float lat2=(b.lat * (float) (M_PI/180));
-    float lon2=(b.lon * (float) (M_PI/180));
-    float clat2=cosf(lat2);
-    return fmodf(atan2f(sinf(lon2-lon1)*clat2, cosf(lat1)*sinf(lat2)-sinf(lat1)*clat2*cosf(lon2-lon1)), (float) (M_PI*2));
+    active_route_t *active_route = active_routes;
+    while (active_route)
+    {
+        if (distanceto(loc, shiploc(active_route)) <= distance) { return 1; }
+        active_route = active_route -> next;
+    }
+    return 0;
 }
 
 
-/* Location distance d along heading h from a [degrees]. Assumes d < circumference/4. http://williams.best.vwh.net/avform.htm#LL */
-static void displaced(loc_t a, double h, double d, dloc_t *b)
+/* Is this location far enough inside the render radius to start a ship there without it being retired straight away */
+static inline int inspawnrange(loc_t loc)
 {
-    double lat1=((double) a.lat * M_PI/180);
-    double lon1=((double) a.lon * M_PI/180);
-    double clat1=cos(lat1);
-    double dang=(d/(double)RADIUS);
-    double sang=sin(dang);
-    b->lat=asin(sin(lat1)*cos(dang)+clat1*sang*cos(h)) * (180*M_1_PI);
-    b->lon=(fmod(lon1+asin(sin(h)*sang/clat1)+M_PI, M_PI*2.0) - M_PI) * (180*M_1_PI);
+    float radius = SPAWN_RADIUS * render_radius;
+    return (rangedistance2(loc) <= radius * radius);
 }
 
 
-/* is this location within distance of the active routes */
-static int tooclose(active_route_t *active_routes, loc_t loc, int distance)
+/* Start a new ship at a random point along the part of its route that's in range, away from other ships if possible,
+ * heading in a random direction. Sets direction, last_node and last_time, and returns the starting location. */
+static loc_t spawnalong(active_route_t *a, float now)
 {
-    active_route_t *active_route = active_routes;
-    while (active_route)
+    const route_t *route = a->route;
+    const loc_t *path = route->path;
+    float radius = SPAWN_RADIUS * render_radius, total = 0, p = 0, len = 0, t0, t1, d;
+    int i, try, seg = 1, last_seg = 0;
+    loc_t loc = path[0];
+    dloc_t dloc;
+
+    /* Length of the route that's in range. Fall back to the whole render radius if it only skims the edge. */
+    for (i=1; i<route->pathlen; i++)
+        if (segmentclip(path[i-1], path[i], radius, &t0, &t1))
+        {
+            total += (t1 - t0) * (a->cumdist[i] - a->cumdist[i-1]);
+            last_seg = i;
+        }
+    if (!last_seg)
+    {
+        radius = (float) render_radius;
+        for (i=1; i<route->pathlen; i++)
+            if (segmentclip(path[i-1], path[i], radius, &t0, &t1))
+            {
+                total += (t1 - t0) * (a->cumdist[i] - a->cumdist[i-1]);
+                last_seg = i;
+            }
+    }
+
+    for (try=0; try<SPAWN_TRIES && last_seg; try++)
+    {
+        d = total * rng_float();
+        for (i=1; i<=last_seg; i++)
+            if (segmentclip(path[i-1], path[i], radius, &t0, &t1))
+            {
+                float inlen;
+                len = a->cumdist[i] - a->cumdist[i-1];
+                inlen = (t1 - t0) * len;
+                if (d < inlen || i == last_seg)
+                {
+                    seg = i;
+                    p = t0 * len + (d < inlen ? d : inlen);
+                    break;
+                }
+                d -= inlen;
+            }
+        displaced(path[seg-1], headingto(path[seg-1], path[seg]), p, &dloc);
+        loc = toloc(&dloc);
+        if (inspawnrange(loc) && !tooclose(active_routes, loc, SHIP_SPACING * a->ship->semilen)) { break; }
+        /* otherwise try again, but settle for the last try */
+    }
+
+    /* The ship's position is semilen + (now-last_time)*speed along the path from last_node */
+    if (rng_next() & 1)
     {
-        loc_t other;
-        if (active_route->new_node)
+        a->direction = 1;
+        a->last_node = seg-1;
+    }
+    else
+    {
+        a->direction = -1;
+        a->last_node = seg;
+        p = len - p;
+    }
+    a->last_time = now - (p - a->ship->semilen) / a->ship->speed;
+    return loc;
+}
+
+
+#if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
+/* Are route names displayed. They're read from routes.txt when ships start, so that drawing doesn't do disk I/O. */
+static int wantnames(void)
+{
+#ifdef DO_ACTIVE_LIST
+    return 1;
+#else
+    return do_local_map;
+#endif
+}
+#endif
+
+
+/* Retire the nth active route */
+static void retire(int n)
+{
+    active_route_t *a = active_route_get(active_routes, n);
+    event_remove(a);
+    route_release(a->route);
+    free(a->cumdist);
+    mem_add(mem_active, -1, -(int) (a->route->pathlen * sizeof(float)));
+    XPLMDestroyProbe(a->ref_probe);		/* Deallocate resources */
+    models_release(a->tile_models);
+    active_route_pop(&active_routes, n);
+    active_n--;
+}
+
+
+/* Index of the active route that's furthest from the viewer. Routes that haven't been drawn yet count as furthest. */
+static int furthest(void)
+{
+    float view_x=input.view_x;
+    float view_z=input.view_z;
+    float dist, furthest_dist=-1;
+    int i, furthest_i=0;
+    active_route_t *a;
+
+    for (i=0, a=active_routes; a; a=a->next, i++)
+    {
+        if (a->new_node) { return i; }
+        dist = (a->drawinfo.x - view_x) * (a->drawinfo.x - view_x) + (a->drawinfo.z - view_z) * (a->drawinfo.z - view_z);
+        if (dist > furthest_dist)
         {
-            /* location hasn't been calculated yet, just use its current node's location */
-            other.lat = active_route->route->path[active_route->last_node].lat;
-            other.lon = active_route->route->path[active_route->last_node].lon;
+            furthest_dist=dist;
+            furthest_i=i;
         }
-        else
+    }
+    return furthest_i;
+}
+
+
+/* Move the ship to wherever its schedule puts it at time now, however many nodes, turnarounds and lingers it has
+ * missed - e.g. under time compression or after a pause. Called when the ship's next_time has passed.
+ *
+ * The schedule of a leg is measured from the time T0 that the ship left the dock (or, for a ship that was started
+ * part-way along its route, the time that it would have done): it leaves node k at T0 - semilen/speed + C(k)/speed,
+ * where C(k) is the distance along the path from the leg's starting end, and reaches the far end semilen/speed earlier
+ * than that to avoid crashing into the dock. It then lingers for LINGER_TIME before setting off in reverse. The
+ * period of a return trip is therefore fixed, and the node is found by binary search on cumulative distance.
+ *
+ * Returns non-zero if the ship is now lingering at the end of its route, with location and heading set. Otherwise
+ * new_node is set, and the rest of the state is updated by drawupdate(). */
+static int catchup(active_route_t *a, float now)
+{
+    route_t *route = a->route;
+    const float *cumdist = a->cumdist;
+    int last = route->pathlen-1;
+    double speed = a->ship->speed;
+    double s = (double) a->ship->semilen / speed;	/* time to travel one semilen */
+    double total = cumdist[last];
+    double travel = total/speed - 2*s;		/* time from leaving one dock to arriving at the other */
+    double period = (travel > 0 ? travel : 0) + (double) LINGER_TIME;	/* time for one leg including linger */
+    double t0, e, d;
+    int direction, lo, hi;
+
+    if ((a->last_node+a->direction < 0) || (a->last_node+a->direction > last))
+    {
+        /* Was lingering - next leg starts when the linger expired */
+        direction = -a->direction;
+        t0 = a->next_time;
+    }
+    else
+    {
+        direction = a->direction;
+        d = direction > 0 ? (double) cumdist[a->last_node] : total - (double) cumdist[a->last_node];
+        t0 = (double) a->last_time + s - d/speed;
+    }
+
+    /* Reduce to within one leg */
+    e = (double) now - t0;
+    if (e < 0) { e = 0; }
+    e = fmod(e, 2*period);
+    if (e >= period)
+    {
+        e -= period;
+        direction = -direction;
+    }
+
+    if (e >= travel)
+    {
+        /* Arrived at the far end, and lingering there */
+        int prev = direction > 0 ? last-1 : 1;
+        a->direction = direction;
+        a->last_node = direction > 0 ? last : 0;
+        a->last_time = (float) ((double) now - (e - travel));
+        a->next_time = a->last_time + LINGER_TIME;
+        a->loc.lat = route->path[a->last_node].lat;
+        a->loc.lon = route->path[a->last_node].lon;
+        a->drawinfo.heading = headingto(route->path[prev], route->path[a->last_node]) * (float) (180*M_1_PI);
+        return 1;
+    }
+
+    /* Find the last node left - i.e. the furthest node with C(k) <= speed * (e + s) */
+    d = speed * (e + s);
+    if (direction > 0)
+    {
+        lo=0; hi=last-1;
+        while (lo < hi)
         {
-            other.lat = active_route->loc.lat;
-            other.lon = active_route->loc.lon;
+            int mid = (lo+hi+1)/2;
+            if ((double) cumdist[mid] <= d) { lo = mid; } else { hi = mid-1; }
         }
-        if (distanceto(loc, other) <= distance) { return 1; }
-        active_route = active_route -> next;
     }
+    else
+    {
+        lo=1; hi=last;
+        while (lo < hi)
+        {
+            int mid = (lo+hi)/2;
+            if (total - (double) cumdist[mid] <= d) { hi = mid; } else { lo = mid+1; }
+        }
+    }
+    a->direction = direction;
+    a->last_node = lo;
+    d = direction > 0 ? (double) cumdist[lo] : total - (double) cumdist[lo];
+    a->last_time = (float) ((double) now - e - s + d/speed);
+    a->new_node = 1;
+    a->next_time = now + HDG_HOLD_TIME;	/* Placeholder, so it's not due again before drawupdate() updates the state */
     return 0;
 }
 
 
+/* Relative chance of picking a route from the candidates */
+static float routeweight(const route_t *route)
+{
+    float w = kind_weights[route->ship_kind];
+    if (length_exponent != 0 && w > 0)
+        w *= powf((route->length > 100 ? route->length : 100) / 1000, length_exponent);	/* [km] */
+    return w;
+}
+
+
+/* Start a new round of route marks */
+static void nextmark(void)
+{
+    if (!++recalc_mark)
+    {
+        routes_clearmarks();
+        recalc_mark=1;
+    }
+}
+
+
+/* Collect the candidate routes - those with a segment in range and a non-zero weight - in the tiles that the render
+ * radius around range_centre covers, and build the alias table to sample them. Returns 0 on alloc failure. */
+static int neighbourhood(void)
+{
+    int i, j;
+    int south, north, west, east;
+    float lat_extent, lon_extent;
+
+    hood_n=0;
+    nextmark();		/* Routes are marked as they're found so that a route that crosses several tiles is only considered once */
+    lat_extent = render_radius / DEG_LENGTH;
+    lon_extent = lat_extent / (range_coslat > 0.05f ? range_coslat : 0.05f);
+    south = (int) floorf(range_centre.lat - lat_extent);
+    north = (int) floorf(range_centre.lat + lat_extent);
+    if (south < -90) { south = -90; }
+    if (north > 89) { north = 89; }
+    if (lon_extent >= 180)
+    {
+        west = -180;
+        east = 179;
+    }
+    else
+    {
+        west = (int) floorf(range_centre.lon - lon_extent);
+        east = (int) floorf(range_centre.lon + lon_extent);
+    }
+    for (i=south; i<=north; i++)
+        for (j=west; j<=east; j++)
+        {
+            int tile_west = j<-180 ? j+360 : (j>=180 ? j-360 : j);
+            route_list_t *route_list;
+
+            if (!getroutecountbyblock(i, tile_west))
+            {
+                j += SUPERBLOCK-1 - (tile_west+180) % SUPERBLOCK;	/* Skip the rest of this empty superblock */
+                continue;
+            }
+            for (route_list=getroutesbytile(i, tile_west); route_list; route_list=route_list->next)
+            {
+                route_t *route=route_list->route;
+                float weight;
+                if (route->mark == recalc_mark) { continue; }
+                route->mark=recalc_mark;
+                if ((weight = routeweight(route)) <= 0 || !routeinrange(route)) { continue; }
+                if (hood_n >= hood_max)
+                {
+                    int new_max = hood_max ? 2*hood_max : 256;
+                    route_t **new_hood;
+                    float *new_weights;
+                    if (!(new_hood = realloc(hood, new_max * sizeof(route_t *)))) { return 0; }
+                    hood = new_hood;
+                    if (!(new_weights = realloc(hood_weights, new_max * sizeof(float)))) { return 0; }
+                    hood_weights = new_weights;
+                    mem_add(mem_candidates, hood_max ? 0 : 2, (new_max-hood_max) * (int) (sizeof(route_t *) + sizeof(float)));
+                    hood_max = new_max;
+                }
+                hood[hood_n] = route;
+                hood_weights[hood_n++] = weight;
+            }
+        }
+
+    return sample_build(hood_weights, hood_n);
+}
+
+
+/* Pick a candidate route that isn't already active, with probability proportional to its weight. Uses the alias
+ * table, which includes active routes, and falls back to a linear scan if most of the weight is already active.
+ * Returns NULL if there's nothing left to pick. */
+static route_t *pickcandidate(void)
+{
+    float total = 0, r;
+    int i, last = -1;
+
+    for (i=0; i<SAMPLE_TRIES; i++)
+    {
+        int pick = sample_pick();
+        if (pick < 0) { return NULL; }
+        if (hood[pick]->mark != recalc_mark) { return hood[pick]; }
+    }
+
+    for (i=0; i<hood_n; i++)
+        if (hood[i]->mark != recalc_mark) { total += hood_weights[i]; }
+    if (total <= 0) { return NULL; }
+    r = total * rng_float();
+    for (i=0; i<hood_n; i++)
+        if (hood[i]->mark != recalc_mark)
+        {
+            last = i;
+            if ((r -= hood_weights[i]) < 0) { break; }
+        }
+    return hood[last];
+}
+
+
 /* Adjust active routes */
 static void recalc(void)
 {
-    int active_i, i, j;
-    int candidate_n=0;
-    route_list_t *candidates=NULL;
+    int active_i, i;
+    float recalc_distance = RECALC_DISTANCE * render_radius;
+    loc_t here;
     active_route_t *a;
 
     need_recalc=0;
 
+    /* The candidates only need to be found again if the plane has moved far enough (or the render radius or weights
+     * have changed) - not just because ships have retired */
+    here.lat=(float) input.plane_lat;
+    here.lon=(float) input.plane_lon;
+    if (!hood_valid || hood_radius != render_radius || rangedistance2(here) > recalc_distance*recalc_distance)
+    {
+        range_centre=here;
+        range_coslat=cosf(range_centre.lat * (float) (M_PI/180));
+        hood_valid=0;
+    }
+
     /* Retire routes that have gone out of range */
     active_i=0;
     a=active_routes;
     while (active_i<active_n)
     {
-        if (!inrange(current_tile, a->route->path[a->last_node]))	/* FIXME: Should check on current position, not last_node */
+        if (!inrange(shiploc(a)))
         {
-            XPLMDestroyProbe(a->ref_probe);				/* Deallocate resources */
-            active_route_pop(&active_routes, active_i);			/* retire out-of-range route */
+            retire(active_i);						/* retire out-of-range route */
             a=active_route_get(active_routes, active_i);		/* get pointer to next item */
-            active_n--;
         }
         else
         {
@@ -171,45 +601,52 @@ static void recalc(void)
         }
     }
 
-    /* Or if rendering options have changed */
+    /* Or if rendering options or the frame budget have changed. Retire the least visible first. */
     while (active_n > active_max)
-    {
-        active_route_pop(&active_routes, rand() % (active_max-active_n));	/* retire a random route */
-        active_n--;
-    }
+        retire(furthest());
 
     if (active_n >= active_max) { return; }	/* We have enough routes */
 
-    /* Locate candidate routes */
-    for (i=current_tile.south-TILE_RANGE; i<=current_tile.south+TILE_RANGE; i++)
-        for (j=current_tile.west-TILE_RANGE; j<=current_tile.west+TILE_RANGE; j++)
-        {
-            route_list_t *route_list=getroutesbytile(i,j);
-            while (route_list)
-            {
-                /* Check it's neither already active nor already a candidate from an adjacent tile */
-                if (!active_route_get_byroute(active_routes, route_list->route) &&
-                    !route_list_get_byroute(candidates, route_list->route) &&
-                    route_list_add(&candidates, route_list->route))
-                {
-                    candidate_n++;
-                }
-                route_list=route_list->next;
-            }
-        }
+    if (!hood_valid)
+    {
+        if (!neighbourhood()) { return; }	/* Alloc failure! */
+        hood_valid=1;
+        hood_radius=render_radius;
+    }
+
+    /* Mark active routes so that they're not picked */
+    nextmark();
+    for (a=active_routes; a; a=a->next)
+        a->route->mark=recalc_mark;
 
     /* Pick new active routes from candidates */
-    if (candidate_n)
+    if (hood_n)
     {
-        float now=XPLMGetDataf(ref_monotonic);
+        float now=input.monotonic;
+        route_t *newroute;
 
-        while ((active_n < active_max) && candidate_n)
+        while ((active_n < active_max) && (newroute = pickcandidate()))
         {
             int obj_n;
             ship_models_t *models;
-            route_t *newroute = route_list_pop(&candidates, rand() % candidate_n--);
-            active_n++;
-            if (!(a = active_route_add(&active_routes))) { break; }	/* Alloc failure! */
+            loc_t start;
+            newroute->mark=recalc_mark;	/* Don't pick it again */
+            if (!route_acquire(newroute)) { break; }	/* Alloc failure! */
+            if (!(a = malloc(sizeof(active_route_t))))
+            {
+                route_release(newroute);
+                break;
+            }
+            if (!(a->cumdist = malloc(newroute->pathlen * sizeof(float))))
+            {
+                route_release(newroute);
+                free(a);
+                break;
+            }
+            mem_add(mem_active, 2, sizeof(active_route_t) + newroute->pathlen * sizeof(float));
+            a->cumdist[0] = 0;
+            for (i=1; i<newroute->pathlen; i++)
+                a->cumdist[i] = a->cumdist[i-1] + distanceto(newroute->path[i-1], newroute->path[i]);
             a->ship=&ships[newroute->ship_kind];
             a->route=newroute;
             a->altmsl=0;
@@ -217,164 +654,234 @@ static void recalc(void)
             a->drawinfo.structSize=sizeof(XPLMDrawInfo_t);
             a->drawinfo.pitch=a->drawinfo.roll=0;
 
-            /* Find a starting node */
-            if (inrange(current_tile, newroute->path[0]) && !tooclose(active_routes->next, newroute->path[0], SHIP_SPACING * a->ship->semilen))
+            /* Start at a dock if there's room, otherwise somewhere along the part of the route that's in range */
+            if (inspawnrange(newroute->path[0]) && !tooclose(active_routes, newroute->path[0], SHIP_SPACING * a->ship->semilen))
             {
                 /* Start of path */
                 a->direction=1;
                 a->last_node=0;
                 a->last_time=now-(a->ship->semilen/a->ship->speed);	/* Move ship away from the dock */
+                start=newroute->path[0];
             }
-            else if (inrange(current_tile, newroute->path[newroute->pathlen-1]) && !tooclose(active_routes->next, newroute->path[newroute->pathlen-1], SHIP_SPACING * a->ship->semilen))
+            else if (inspawnrange(newroute->path[newroute->pathlen-1]) && !tooclose(active_routes, newroute->path[newroute->pathlen-1], SHIP_SPACING * a->ship->semilen))
             {
                 /* End of path */
                 a->direction=-1;
                 a->last_node=newroute->pathlen-1;
                 a->last_time=now-(a->ship->semilen/a->ship->speed);	/* Move ship away from the dock */
+                start=newroute->path[newroute->pathlen-1];
             }
             else
             {
-                a->direction=0;
-                for (i=1; i<newroute->pathlen-1; i++)
-                    if (inrange(current_tile, newroute->path[i]) && !tooclose(active_routes->next, newroute->path[i], SHIP_SPACING * a->ship->semilen))
-                    {
-                        /* First node in range */
-                        a->direction=1;
-                        a->last_node=i;
-                        a->last_time=now;
-                        break;
-                    }
-                if (!a->direction)
-                {
-                    /* Found nothing suitable! Look again, and just shove the ship along its path */
-                    a->last_time = now - (SHIP_SPACING * a->ship->semilen / a->ship->speed);
-                    if (inrange(current_tile, newroute->path[0]))
-                    {
-                        /* Start of path */
-                        a->direction=1;
-                        a->last_node=0;
-                    }
-                    else if (inrange(current_tile, newroute->path[newroute->pathlen-1]))
-                    {
-                        /* End of path */
-                        a->direction=-1;
-                        a->last_node=newroute->pathlen-1;
-                    }
-                    else
-                    {
-                        for (i=1; i<newroute->pathlen-1; i++)
-                            if (inrange(current_tile, newroute->path[i]))
-                            {
-                                /* First node in range */
-                                a->direction=1;
-                                a->last_node=i;
-                                break;
-                            }
-                    }
-                }
+                start=spawnalong(a, now);
             }
 
-            /* Choose ship model based on starting node's tile */
-            models = models_for_tile((int) floorf(newroute->path[a->last_node].lat), (int) floorf(newroute->path[a->last_node].lon)) + a->route->ship_kind;
-            obj_n = rand() % models->obj_n;
+            /* Choose ship model based on starting location's tile */
+            a->tile_models = models_for_tile((int) floorf(start.lat), (int) floorf(start.lon));
+            models = a->tile_models->models + a->route->ship_kind;
+            obj_n = rng_below(models->obj_n);
             a->object_ref = &models->refs[obj_n];	/* May be NULL until async load completes */
-            a->object_name = models->names[obj_n];
+            a->model_id = models->ids[obj_n];
 
             a->new_node=1;		/* Tell drawships() to calculate state */
+            a->tick_phase=next_tick_phase++;
+            a->id=next_ship_id++;
             a->next_time = a->last_time + distanceto(newroute->path[a->last_node], newroute->path[a->last_node+a->direction]) / a->ship->speed;
+            if (!event_add(a))
+            {
+                /* Alloc failure! */
+                XPLMDestroyProbe(a->ref_probe);
+                models_release(a->tile_models);
+                route_release(newroute);
+                free(a->cumdist);
+                free(a);
+                mem_add(mem_active, -2, -(int) (sizeof(active_route_t) + newroute->pathlen * sizeof(float)));
+                break;
+            }
+
+            active_route_add(&active_routes, a);	/* Kept grouped by model id for more efficient drawing */
+            active_n++;
+#if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
+            if (wantnames()) { route_loadname(newroute); }
+#endif
         }
-        active_route_sort(&active_routes, active_n);	/* Sort active routes by object name for more efficient drawing */
     }
-    route_list_free(&candidates);
 }
 
 
-static int drawupdate(void)
+/* Start loading the models for tiles that are about to come into range - those around the plane's current tile,
+ * and those around the tile that it will reach in PREFETCH_TIME at its current ground speed and track.
+ * Library lookups aren't free, so at most one tile is looked at per frame. */
+static void prefetch(void)
 {
-    static float next_hdg_update=0.0f;
+    static tile_t done_tile={INT_MIN,INT_MIN}, done_ahead={INT_MIN,INT_MIN};	/* Tiles that we've finished with */
+    static int done_radius=0;
+    loc_t here;
+    dloc_t ahead;
+    tile_t ahead_tile;
+    float dist;
+    int i, j, lat_range, lon_range;
+
+    here.lat=(float) input.plane_lat;
+    here.lon=(float) input.plane_lon;
+    dist=input.plane_gs * PREFETCH_TIME;
+    if (dist > PREFETCH_MAX) { dist=PREFETCH_MAX; }
+    displaced(here, (double) input.plane_track * (M_PI/180), dist, &ahead);
+    ahead_tile.south=(int) floor(ahead.lat);
+    ahead_tile.west=(int) floor(ahead.lon);
+
+    if ((current_tile.south==done_tile.south) && (current_tile.west==done_tile.west) &&
+        (ahead_tile.south==done_ahead.south) && (ahead_tile.west==done_ahead.west) && (render_radius==done_radius)) { return; }
+
+    tilerange(&lat_range, &lon_range);
+    for (i=current_tile.south-lat_range-1; i<=current_tile.south+lat_range+1; i++)
+        for (j=current_tile.west-lon_range-1; j<=current_tile.west+lon_range+1; j++)
+            if (models_prefetch(i, j)) { return; }
+    for (i=ahead_tile.south-lat_range; i<=ahead_tile.south+lat_range; i++)
+        for (j=ahead_tile.west-lon_range; j<=ahead_tile.west+lon_range; j++)
+            if (models_prefetch(i, j)) { return; }
+
+    done_tile=current_tile;
+    done_ahead=ahead_tile;
+    done_radius=render_radius;
+}
+
+
+static int failinit(char *outDescription);
+
+/* Has the loader thread finished reading routes.txt? */
+static int routesready(void)
+{
+    char err[256], buf[128];
+    double elapsed;
+    int count;
+
+    if (routes_ready) { return routes_ready > 0; }
+    if (!(routes_ready = routes_poll(err, &elapsed, &count))) { return 0; }
+    if (routes_ready < 0)
+    {
+        failinit(err);
+        return 0;
+    }
+    sprintf(buf, "SeaTraffic: Read %d routes from routes.txt in %.0fms, ready %.0fms after start\n", count, elapsed / 1000.0, (perf_time() - start_time) / 1000.0);
+    XPLMDebugString(buf);
+    routes_summary();
+    mem_summary();
+    return 1;
+}
 
+
+static int drawupdate(void)
+{
     tile_t new_tile;
-    float now;
-    int do_hdg_update, active_i;
+    loc_t here;
+    float now, recalc_distance;
+    double x, y, z;			/* OpenGL coords */
+    int do_hdg_update, origin_shift, active_i, lat_range, lon_range, event_count=0;
     XPLMProbeInfo_t probeinfo;
     active_route_t *a;
 
-    /* If we've shifted tile (which can happen without an airport or scenery re-load) then recalculate active routes */
-    new_tile.south=(int) floor(XPLMGetDatad(ref_plane_lat));
-    new_tile.west=(int) floor(XPLMGetDatad(ref_plane_lon));
-    if (need_recalc || (new_tile.south!=current_tile.south) || (new_tile.west!=current_tile.west))
+    if (!routesready()) { return 1; }	/* Nothing to do until routes.txt has been read */
+    if (models_failed())
+    {
+        while (active_n) { retire(0); }	/* Ships may have been started while the default models were loading */
+        return 1;
+    }
+
+    /* If we've moved far enough (which can happen without an airport or scenery re-load) then recalculate active routes */
+    new_tile.south=(int) floor(input.plane_lat);
+    new_tile.west=(int) floor(input.plane_lon);
+    here.lat=(float) input.plane_lat;
+    here.lon=(float) input.plane_lon;
+    recalc_distance=RECALC_DISTANCE * render_radius;
+    current_tile=new_tile;
+    if (need_recalc || rangedistance2(here) > recalc_distance*recalc_distance)
     {
-        current_tile.south=new_tile.south;
-        current_tile.west=new_tile.west;
+        double start=perf_time();
         recalc();
+        perf_add_nested(perf_recalc, perf_update, start);	/* drawships() times update around us */
     }
+    prefetch();
+    tilerange(&lat_range, &lon_range);
+    models_evict(current_tile, lon_range);
 
     if (active_n==0) { return 1; }	/* Nothing to do */
 
     probeinfo.structSize = sizeof(XPLMProbeInfo_t);
 
     /* Headings change slowly. Reduce time in this function by updating them only periodically */
-    now = XPLMGetDataf(ref_monotonic);
+    now = input.monotonic;
     do_hdg_update = (now>=next_hdg_update);
     if (do_hdg_update)
-    {
         next_hdg_update=now+HDG_HOLD_TIME;
-#ifdef DO_ACTIVE_LIST
-        drawmax=0;			/* This iteration is a good time to reset max draw timer */
-#endif
+
+    /* Node transitions. Only ships whose next_time has come round need attention. */
+    while ((a=event_due(now)))
+    {
+        if (catchup(a, now))
+        {
+            /* Lingering at end of route. Keep location and heading - don't set new_node flag. But since we'll be here a while do update alt. */
+            XPLMProbeResult result;
+            double t;
+            t=perf_time();
+            XPLMWorldToLocal(a->loc.lat, a->loc.lon, 0.0, &x, &y, &z);
+            t=perf_add(perf_local, t);
+            probeinfo.locationY=y;	/* If probe fails set altmsl=0 */
+            result=XPLMProbeTerrainXYZ(a->ref_probe, x, y, z, &probeinfo);
+            perf_add(perf_probe, t);
+            assert (result==xplm_ProbeHitTerrain);
+            a->altmsl=(double) probeinfo.locationY - y;
+            /* Stationary, so no need to update it again until it sets off */
+            a->drawinfo.x=a->local_x=(float) x; a->drawinfo.y=probeinfo.locationY; a->drawinfo.z=a->local_z=(float) z;
+            a->vel_x=a->vel_z=0;
+            a->tick_time=now;
+        }
+        event_update(a);
+        event_count++;
+    }
+    perf_count(perf_update, event_count);
+
+    /* If X-Plane has moved the origin of its local co-ordinate system then all extrapolated positions are wrong */
+    XPLMWorldToLocal(origin_ref.lat, origin_ref.lon, 0.0, &x, &y, &z);
+    origin_shift = !origin_valid || fabs(x - origin_x) > 0.01 || fabs(z - origin_z) > 0.01;
+    if (origin_shift)
+    {
+        origin_valid=1;
+        origin_ref.lat=input.plane_lat;
+        origin_ref.lon=input.plane_lon;
+        XPLMWorldToLocal(origin_ref.lat, origin_ref.lon, 0.0, &origin_x, &y, &origin_z);
     }
 
     /* Draw ships */
+    memset(tier_n, 0, sizeof(tier_n));
+    update_frame++;
     active_i=0;
     a=active_routes;
     while (active_i<active_n)
     {
-        double x, y, z;			/* OpenGL coords */
+        double t;
         route_t *route=a->route;
 
-        if (now >= a->next_time)
+        /* Ships further from the viewer are only updated every few frames, and extrapolated in between */
+        if (!a->new_node && !do_hdg_update && !origin_shift)
         {
-            /* Time for next node */
-            a->last_node+=a->direction;
-            if ((a->last_node < 0) || (a->last_node >= route->pathlen))
-            {
-                /* Already was at end of route - turn it round */
-                a->new_node=1;
-                a->direction*=-1;					/* reverse */
-                a->last_node+=a->direction;
-                a->last_time=now-(a->ship->semilen/a->ship->speed);	/* Move ship away from the dock */
-            }
-            else if (!inrange(current_tile, a->route->path[a->last_node]))
+            float dt = now - a->tick_time;
+            float local_x = a->local_x + a->vel_x * dt;
+            float local_z = a->local_z + a->vel_z * dt;
+            a->tier = tierfor(local_x - input.view_x, local_z - input.view_z);
+            if ((update_frame + a->tick_phase) & (tier_interval[a->tier]-1))
             {
-                /* No longer in range - kill it off on next callback */
-                need_recalc=1;
+                a->drawinfo.x=local_x; a->drawinfo.z=local_z;
+                tier_n[a->tier]++;
                 a=a->next;
                 active_i++;
                 continue;
             }
-            else
-            {
-                /* Next node */
-                if ((a->last_node == 0) || (a->last_node == route->pathlen-1))
-                {
-                    /* Just hit end of route */
-                    XPLMProbeResult result;
-                    a->last_time=now;
-                    a->next_time=now+LINGER_TIME;
-                    /* Keep previous location and heading - don't set new_node flag. But since we'll be here a while do update alt. */
-                    XPLMWorldToLocal(a->loc.lat, a->loc.lon, 0.0, &x, &y, &z);
-                    probeinfo.locationY=y;	/* If probe fails set altmsl=0 */
-                    result=XPLMProbeTerrainXYZ(a->ref_probe, x, y, z, &probeinfo);
-                    assert (result==xplm_ProbeHitTerrain);
-                    a->altmsl=(double) probeinfo.locationY - y;
-                }
-                else
-                {
-                    /* Progress to next node on route */
-                    a->new_node=1;
-                    a->last_time=now;
-                }
-            }
+        }
+
+        if (a->new_node)
+        {
+            /* State is calculated below */
         }
         else if ((a->last_node+a->direction < 0) || (a->last_node+a->direction >= route->pathlen))
         {
@@ -403,6 +910,7 @@ static int drawupdate(void)
                 /* Next node is last node */
                 a->next_time-=(a->ship->semilen/a->ship->speed);	/* Stop ship before it crashes into dock */
             }
+            event_update(a);
         }
 
         /* Update altitiude at same time as heading */
@@ -411,18 +919,41 @@ static int drawupdate(void)
             /* Not all routes are at sea level, so need a way of determining altitude but without probing every cycle.
              * Should probably probe twice - http://forums.x-plane.org/index.php?showtopic=38688&st=20#entry566469 */
             XPLMProbeResult result;
+            t=perf_time();
             XPLMWorldToLocal(a->loc.lat, a->loc.lon, 0.0, &x, &y, &z);
+            t=perf_add(perf_local, t);
             probeinfo.locationY=y;	/* If probe fails set altmsl=0 */
             result=XPLMProbeTerrainXYZ(a->ref_probe, x, y, z, &probeinfo);
+            perf_add(perf_probe, t);
             assert (result==xplm_ProbeHitTerrain);
             a->altmsl=(double) probeinfo.locationY - y;
         }
 
         /* In local co-ordinates for drawing */
+        t=perf_time();
         XPLMWorldToLocal(a->loc.lat, a->loc.lon, a->altmsl, &x, &y, &z);
+        perf_add(perf_local, t);
         a->drawinfo.x=x; a->drawinfo.y=y; a->drawinfo.z=z;	/* double -> float */
 
+        /* Remember where and how fast it's going, for extrapolation */
+        a->local_x=a->drawinfo.x;
+        a->local_z=a->drawinfo.z;
+        a->tick_time=now;
+        if ((a->last_node+a->direction < 0) || (a->last_node+a->direction >= route->pathlen))
+        {
+            a->vel_x=a->vel_z=0;	/* lingering */
+        }
+        else
+        {
+            a->vel_x=  a->ship->speed * sinf(a->last_hdg);	/* local co-ordinates are +x=east, -z=north */
+            a->vel_z= -a->ship->speed * cosf(a->last_hdg);
+        }
+        a->tier = tierfor(a->drawinfo.x - input.view_x, a->drawinfo.z - input.view_z);
+        tier_n[a->tier]++;
+
         a->new_node=0;
+        if (!inrange(shiploc(a)))
+            need_recalc=1;	/* No longer in range - kill it off on next callback */
         a=a->next;
         active_i++;
     }
@@ -431,6 +962,135 @@ static int drawupdate(void)
 }
 
 
+/* Adjust the number of active routes so that our own per-frame cost tends towards frame_budget.
+ * Changes are limited to BUDGET_STEP per BUDGET_INTERVAL so that ships appear and disappear gradually. */
+static void budgetupdate(float now)
+{
+    float ratio;
+    int new_max;
+
+    if (!frame_budget || !active_base || (frame_cost_avg <= 0) || (now < next_budget_update)) { return; }
+    next_budget_update = now + BUDGET_INTERVAL;
+
+    ratio = (float) (frame_budget / frame_cost_avg);
+    if (ratio < 1)
+    {
+        /* Over budget */
+        if (ratio < 1-BUDGET_STEP) { ratio = 1-BUDGET_STEP; }
+        new_max = (int) (active_max * ratio);
+        if (new_max >= active_max) { new_max = active_max-1; }
+    }
+    else if ((ratio > 1+2*BUDGET_STEP) && (active_n >= active_max))	/* Only ask for more if we're using what we've got */
+    {
+        /* Comfortably under budget */
+        if (ratio > 1+BUDGET_STEP) { ratio = 1+BUDGET_STEP; }
+        new_max = (int) (active_max * ratio);
+        if (new_max <= active_max) { new_max = active_max+1; }
+    }
+    else
+    {
+        return;
+    }
+
+    if (new_max < ACTIVE_MIN) { new_max = ACTIVE_MIN; }
+    if (new_max > ACTIVE_MAX) { new_max = ACTIVE_MAX; }
+    if (active_max != new_max)
+    {
+        active_max = new_max;
+        need_recalc = 1;
+    }
+}
+
+
+/* Sample the datarefs that drive us, apart from rentype */
+static void inputread(sim_input_t *in)
+{
+    in->plane_lat  =XPLMGetDatad(ref_plane_lat);
+    in->plane_lon  =XPLMGetDatad(ref_plane_lon);
+    in->plane_gs   =XPLMGetDataf(ref_plane_gs);
+    in->plane_track=XPLMGetDataf(ref_plane_track);
+    in->view_x     =XPLMGetDataf(ref_view_x);
+    in->view_y     =XPLMGetDataf(ref_view_y);
+    in->view_z     =XPLMGetDataf(ref_view_z);
+    in->view_h     =XPLMGetDataf(ref_view_h);
+    in->night      =XPLMGetDataf(ref_night);
+    in->monotonic  =XPLMGetDataf(ref_monotonic);
+    in->renopt     =ref_renopt ? XPLMGetDatai(ref_renopt) : -1;
+}
+
+
+/* Number of active routes implied by the "number of objects" rendering option */
+static void setactivebase(int renopt)
+{
+    int new_active_base = renopt * RENDERING_SCALE;
+    if (new_active_base > ACTIVE_FIXED_MAX) { new_active_base = ACTIVE_FIXED_MAX; }
+    if (active_base != new_active_base)
+    {
+        active_base = active_max = new_active_base;	/* Frame budget adjusts from here, unless objects are turned off */
+        need_recalc = 1;
+    }
+}
+
+
+/* Forget all active routes and reseed the rng, so that what follows can be reproduced from a recording */
+static void restart(unsigned int seed)
+{
+    while (active_n) { retire(0); }
+    query_frame(NULL);
+    rng_seed(seed);
+    hood_valid = 0;	/* Rebuild from scratch, so that the same candidates are sampled in the same order */
+    need_recalc = 1;
+    last_frame = next_hdg_update = next_budget_update = 0;
+}
+
+
+/* Path of a file in the X-Plane folder, next to Log.txt */
+static void xplanepath(char *path, const char *name)
+{
+    strncpy(path, mypath, relpath-mypath);
+    path[relpath-mypath] = '\0';
+    strcat(path, name);
+}
+
+
+static void replayend(void)
+{
+    replay_stop();
+    do_replay = 0;
+    XPLMCheckMenuItem(my_menu_id, menu_idx_replay, xplm_Menu_Unchecked);
+    if (ref_renopt) { setactivebase(XPLMGetDatai(ref_renopt)); }
+    restart((unsigned int) time(NULL));
+}
+
+
+/* Get the inputs for this draw callback. The render pass always comes from the sim. The rest only changes once per
+ * frame, and comes from the recording if replaying, so that a replay keeps in step with the recording however many
+ * render passes the sim makes in each frame. */
+static void inputupdate(void)
+{
+    static float live_frame = -1;
+    float monotonic = XPLMGetDataf(ref_monotonic);
+    int renopt = input.renopt;
+
+    if (monotonic != live_frame)	/* First callback of a new frame */
+    {
+        live_frame = monotonic;
+        if (do_replay && !replay_input(&input))
+            replayend();	/* End of recording - back to the live sim */
+        if (do_replay)
+        {
+            if ((input.renopt >= 0) && (input.renopt != renopt)) { setactivebase(input.renopt); }
+        }
+        else
+        {
+            inputread(&input);
+            if (do_record) { record_input(&input); }
+        }
+    }
+    input.rentype = XPLMGetDatai(ref_rentype);
+}
+
+
 /* XPLMRegisterDrawCallback callback */
 static int drawships(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
 {
@@ -438,48 +1098,51 @@ static int drawships(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
     int is_night;
     float now;
     float view_x, view_z;
-    int render_pass;
-#ifdef DO_ACTIVE_LIST
-# if IBM
-    __int64 t1, t2;
-    QueryPerformanceCounter((LARGE_INTEGER *) &t1);	/* start */
-# else
-    struct timeval t1, t2;
-    gettimeofday(&t1, NULL);		/* start */
-# endif
-#endif
+    int render_pass, drawn=0;
+    perf_phase_t pass;
+    double start=perf_time(), t;
 
     assert((inPhase==xplm_Phase_Objects) && inIsBefore);
 
+    inputupdate();
+
     /* We're potentially called multiple times per frame:
      * reflections ("sim/graphics/view/world_render_type" == 1), multiple shadows (== 3) and finally normal (== 0).
      * So skip calculations if we've already run the calculations for this frame. */
-    if ((now = XPLMGetDataf(ref_monotonic)) != last_frame)
+    if ((now = input.monotonic) != last_frame)
     {
+        budgetupdate(now);
         drawupdate();
+        if (do_export) { export_frame(active_routes, now); }
+        query_frame(active_routes);
+        perf_add(perf_update, start);
         last_frame = now;
-#ifdef DO_ACTIVE_LIST
-        drawtime = 0;
-#endif
     }
+    t=perf_time();
 
-    render_pass = XPLMGetDatai(ref_rentype);
-    is_night = (int) (XPLMGetDataf(ref_night) + 0.67f);
-    view_x=XPLMGetDataf(ref_view_x);
-    view_z=XPLMGetDataf(ref_view_z);
+    render_pass = input.rentype;
+    is_night = (int) (input.night + 0.67f);
+    view_x=input.view_x;
+    view_z=input.view_z;
 
     if (render_pass == 1)		/* reflections */
     {
         for (a=active_routes; a; a=a->next)
             if (*a->object_ref && inreflectrange(a->drawinfo.x - view_x, a->drawinfo.z - view_z))
+            {
                 XPLMDrawObjects(*a->object_ref, 1, &(a->drawinfo), is_night, 1);
+                drawn++;
+            }
         do_wakes = 1;			/* Do wakes on base pass if reflections enabled */
     }
     else				/* shadows or base */
     {
         for (a=active_routes; a; a=a->next)
             if (*a->object_ref && indrawrange(a->drawinfo.x - view_x, a->drawinfo.z - view_z))
+            {
                 XPLMDrawObjects(*a->object_ref, 1, &(a->drawinfo), is_night, 1);
+                drawn++;
+            }
 
         /* Wakes. Drawn after drawing the ships, so that the ships' hulls are visible through alpha.
          * Batched together to reduce texture swaps. */
@@ -495,21 +1158,26 @@ static int drawships(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
                     (a->last_node+a->direction >= 0) && (a->last_node+a->direction < a->route->pathlen) &&	/* and not lingering */
                     inwakerange(a->drawinfo.x - view_x, a->drawinfo.z - view_z))				/* and closeish */
                 {
-                    XPLMDrawObjects(a->ship->semilen >= WAKE_BIG ? wake_big_ref : (a->ship->semilen >= WAKE_MED ? wake_med_ref : wake_sml_ref), 1, &(a->drawinfo), 0, 1);
+                    XPLMObjectRef wake_ref = a->ship->semilen >= WAKE_BIG ? wake_big_ref : (a->ship->semilen >= WAKE_MED ? wake_med_ref : wake_sml_ref);
+                    if (wake_ref)	/* may still be loading */
+                        XPLMDrawObjects(wake_ref, 1, &(a->drawinfo), 0, 1);
                 }
             glDisable(GL_POLYGON_OFFSET_FILL);
         }
     }
 
+    pass = render_pass == 1 ? perf_reflect : (render_pass == 0 ? perf_base : perf_shadow);
+    perf_add(pass, t);
+    perf_count(pass, drawn);
+    frame_cost += perf_time() - start;
+    if (render_pass == 0)		/* base pass is the last in the frame */
+    {
+        frame_cost_avg += (frame_cost - frame_cost_avg) * BUDGET_SMOOTHING;
+        frame_cost = 0;
+        perf_frame(active_n);
+    }
+
 #ifdef DO_ACTIVE_LIST
-# if IBM
-    QueryPerformanceCounter((LARGE_INTEGER *) &t2);	/* stop */
-    drawtime += ((t2 - t1) * 1000000) / ticks_per_sec;
-# else
-    gettimeofday(&t2, NULL);		/* stop */
-    drawtime += (t2.tv_sec-t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec;
-# endif
-    if (drawtime>drawmax) { drawmax=drawtime; }
     if (!render_pass) { last_frame = 0; }	/* In DEBUG recalculate while paused for easier debugging / profiling */
 #endif
     return 1;
@@ -517,57 +1185,199 @@ static int drawships(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
 
 
 #ifdef DO_LOCAL_MAP
-/* Work out screen locations in local map */
-static int drawmap3d(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
+/* Release the paths of the routes in a tile, up to but not including stop */
+static void mapreleasetile(int south, int west, route_t *stop)
 {
     route_list_t *route_list;
-    int i, j;
-
-    if (!do_local_map) { return 1; }
+    for (route_list=getroutesbytile(south,west); route_list && route_list->route!=stop; route_list=route_list->next)
+        route_release(route_list->route);
+}
 
-    if (active_n)
+/* Convert the routes in a tile to local co-ordinates for the local map.
+ * Each segment is stored against the tiles of both of its nodes, so a tile's polylines don't depend on which other
+ * tiles are in the cache. Segments that cross a tile boundary get drawn twice, which is harmless. */
+static void mapcachetile(map_tile_t *map_tile, int south, int west)
+{
+    route_list_t *route_list;
+    int k, n=0;
+    float *v;
+
+    if (map_tile->verts) { mem_add(mem_map, -1, -(int) (map_tile->vert_n*3*sizeof(float))); }
+    free(map_tile->verts);
+    map_tile->verts=NULL;
+    map_tile->vert_n=0;
+    map_tile->tile.south=south;
+    map_tile->tile.west=west;
+
+    /* Paths are decoded for the duration */
+    for (route_list=getroutesbytile(south,west); route_list; route_list=route_list->next)
+    {
+        route_t *route=route_list->route;
+        if (!route_acquire(route))
+        {
+            mapreleasetile(south, west, route);
+            return;
+        }
+        for (k=0; k<route->pathlen-1; k++)
+            if (intile(south, west, route->path[k]) || intile(south, west, route->path[k+1]))
+                n+=2;
+    }
+    if (!n || !(v=map_tile->verts=malloc(n*3*sizeof(float))))
     {
-        GLdouble model[16], proj[16], winX, winY, winZ;
-        GLint view[4];
-        active_route_t *a;
+        mapreleasetile(south, west, NULL);
+        return;
+    }
+    mem_add(mem_map, 1, n*3*sizeof(float));
+    map_tile->vert_n=n;
 
-        /* This is slow, but it's only the local map */
-        glGetDoublev(GL_MODELVIEW_MATRIX, model);
-        glGetDoublev(GL_PROJECTION_MATRIX, proj);
-        glGetIntegerv(GL_VIEWPORT, view);
+    for (route_list=getroutesbytile(south,west); route_list; route_list=route_list->next)
+    {
+        route_t *route=route_list->route;
+        double x0=0, y0=0, z0=0, x, y, z;
+        int have0=0;		/* x0,y0,z0 already hold path[k] */
 
-        a=active_routes;
-        while (a!=NULL)
+        for (k=0; k<route->pathlen-1; k++)
         {
-            gluProject(a->drawinfo.x, a->drawinfo.y, a->drawinfo.z, model, proj, view, &winX, &winY, &winZ);
-            a->mapx=winX;
-            a->mapy=winY;
-            a=a->next;
+            if (!intile(south, west, route->path[k]) && !intile(south, west, route->path[k+1]))
+            {
+                have0=0;
+                continue;
+            }
+            if (!have0)
+                XPLMWorldToLocal(route->path[k].lat, route->path[k].lon, 0.0, &x0, &y0, &z0);
+            XPLMWorldToLocal(route->path[k+1].lat, route->path[k+1].lon, 0.0, &x, &y, &z);
+            *(v++)=x0; *(v++)=y0; *(v++)=z0;	/* double -> float */
+            *(v++)=x;  *(v++)=y;  *(v++)=z;
+            x0=x; y0=y; z0=z;
+            have0=1;
         }
     }
+    mapreleasetile(south, west, NULL);
+}
+
+
+/* Discard cached route polylines */
+static void mapflush(void)
+{
+    int i;
+    for (i=0; i<sizeof(map_tiles)/sizeof(map_tile_t); i++)
+    {
+        if (map_tiles[i].verts) { mem_add(mem_map, -1, -(int) (map_tiles[i].vert_n*3*sizeof(float))); }
+        free(map_tiles[i].verts);
+        map_tiles[i].verts=NULL;
+        map_tiles[i].vert_n=0;
+        map_tiles[i].tile.south=INT_MIN;	/* never matches a real tile */
+    }
+}
+
+
+/* Make sure the route polylines for the tiles around the plane are cached.
+ * Tiles that stay in range across a tile change are kept. Everything is re-converted if the local origin shifts. */
+static void mapcache(void)
+{
+    double x, y, z;
+    int i, j, k, n=sizeof(map_tiles)/sizeof(map_tile_t);
+
+    XPLMWorldToLocal(current_tile.south, current_tile.west, 0.0, &x, &y, &z);
+    if (x!=map_origin[0] || y!=map_origin[1] || z!=map_origin[2])
+    {
+        mapflush();
+        map_origin[0]=x; map_origin[1]=y; map_origin[2]=z;
+    }
+
+    /* Free up slots for tiles that have gone out of range */
+    for (k=0; k<n; k++)
+        if ((map_tiles[k].tile.south!=INT_MIN) &&
+            ((abs(map_tiles[k].tile.south - current_tile.south) > TILE_RANGE) || (abs(map_tiles[k].tile.west - current_tile.west) > TILE_RANGE)))
+            map_tiles[k].tile.south=INT_MIN;
 
-    XPLMSetGraphicsState(0, 0, 0,   0, 0,   0, 0);
-    glColor3f(0,0,0.25);
     for (i=current_tile.south-TILE_RANGE; i<=current_tile.south+TILE_RANGE; i++)
         for (j=current_tile.west-TILE_RANGE; j<=current_tile.west+TILE_RANGE; j++)
         {
-            route_list=getroutesbytile(i,j);
-            while (route_list)
-            {
-                route_t *route=route_list->route;
-                int k;
+            for (k=0; k<n; k++)
+                if (map_tiles[k].tile.south==i && map_tiles[k].tile.west==j) { break; }
+            if (k<n) { continue; }	/* already cached */
 
-                glBegin(GL_LINE_STRIP);
-                for (k=0; k<route->pathlen; k++)
+            for (k=0; k<n; k++)
+                if (map_tiles[k].tile.south==INT_MIN)
                 {
-                    double x, y, z;
-                    XPLMWorldToLocal(route->path[k].lat, route->path[k].lon, 0.0, &x, &y, &z);
-                    glVertex3f(x,y,z);
+                    mapcachetile(&map_tiles[k], i, j);
+                    break;
                 }
-                glEnd();
-                route_list=route_list->next;
-            }
+            assert(k<n);
         }
+}
+
+
+/* Work out screen locations of the ships in the local map.
+ * Equivalent to gluProject, but the modelview and projection matrices are combined once per frame and then applied
+ * to all ships in one loop over packed arrays, which the compiler can vectorise. */
+static void mapproject(void)
+{
+    static float px[ACTIVE_MAX], py[ACTIVE_MAX], pz[ACTIVE_MAX];	/* ship positions, then window co-ordinates */
+    GLfloat model[16], proj[16], m[16];
+    GLint view[4];
+    float vx, vy, vw, vh;
+    active_route_t *a;
+    int i, j, n;
+
+    glGetFloatv(GL_MODELVIEW_MATRIX, model);
+    glGetFloatv(GL_PROJECTION_MATRIX, proj);
+    glGetIntegerv(GL_VIEWPORT, view);
+
+    /* m = proj * model. Column-major, as OpenGL */
+    for (i=0; i<4; i++)
+        for (j=0; j<4; j++)
+            m[j*4+i] = proj[i]*model[j*4] + proj[4+i]*model[j*4+1] + proj[8+i]*model[j*4+2] + proj[12+i]*model[j*4+3];
+
+    for (n=0, a=active_routes; a && n<ACTIVE_MAX; a=a->next, n++)
+    {
+        px[n]=a->drawinfo.x;
+        py[n]=a->drawinfo.y;
+        pz[n]=a->drawinfo.z;
+    }
+
+    /* Fold the viewport transform into the loop */
+    vw=view[2]*0.5f; vh=view[3]*0.5f;
+    vx=view[0]+vw;   vy=view[1]+vh;
+    for (i=0; i<n; i++)
+    {
+        float x=px[i], y=py[i], z=pz[i];
+        float cw = m[3]*x + m[7]*y + m[11]*z + m[15];
+        float rw = (cw != 0) ? 1/cw : 0;
+        px[i] = vx + vw * rw * (m[0]*x + m[4]*y + m[8]*z  + m[12]);
+        py[i] = vy + vh * rw * (m[1]*x + m[5]*y + m[9]*z  + m[13]);
+    }
+
+    for (i=0, a=active_routes; i<n; a=a->next, i++)
+    {
+        a->mapx=px[i];
+        a->mapy=py[i];
+    }
+}
+
+
+/* Work out screen locations in local map */
+static int drawmap3d(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
+{
+    int i;
+
+    if (!do_local_map || routes_ready <= 0) { return 1; }
+
+    if (active_n) { mapproject(); }
+
+    mapcache();
+
+    XPLMSetGraphicsState(0, 0, 0,   0, 0,   0, 0);
+    glColor3f(0,0,0.25);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    for (i=0; i<sizeof(map_tiles)/sizeof(map_tile_t); i++)
+        if (map_tiles[i].vert_n)
+        {
+            glVertexPointer(3, GL_FLOAT, 0, map_tiles[i].verts);
+            glDrawArrays(GL_LINES, 0, map_tiles[i].vert_n);
+        }
+    glDisableClientState(GL_VERTEX_ARRAY);
 
     return 1;
 }
@@ -587,7 +1397,7 @@ static int drawmap2d(XPLMDrawingPhase inPhase, int inIsBefore, void *inRefcon)
     a=active_routes;
     while (a!=NULL)
     {
-        XPLMDrawString(color, a->mapx+6, a->mapy-3, a->route->name, NULL, xplmFont_Proportional);
+        XPLMDrawString(color, a->mapx+6, a->mapy-3, (char *) route_name(a->route), NULL, xplmFont_Proportional);
         XPDrawElement(a->mapx-width/2, a->mapy-height+height/2, a->mapx+width-width/2, a->mapy+height/2, xpElement_CustomObject, 0);
         a=a->next;
     }
@@ -603,32 +1413,48 @@ static void drawdebug(XPLMWindowID inWindowID, void *inRefcon)
     char buf[256];
     int top, bottom;
     static int left=10, right=310;
+    int i, prefetched, early, late, loaded, evicted;
+    float update, update_avg, update_max;
     float width, width1;
     float color[] = { 1.0, 1.0, 1.0 };	/* RGB White */
-    float now=XPLMGetDataf(ref_monotonic);
-    float view_x=XPLMGetDataf(ref_view_x);
-    float view_z=XPLMGetDataf(ref_view_z);
+    float now=input.monotonic;
+    float view_x=input.view_x;
+    float view_z=input.view_z;
 
     active_route_t *a=active_routes;
 
     XPLMGetScreenSize(NULL, &top);
     top-=20;	/* leave room for X-Plane's menubar */
-    bottom=top-40-60*active_route_length(active_routes);
+    bottom=top-60-60*active_route_length(active_routes);
     XPLMSetWindowGeometry(inWindowID, left, top, right, bottom);
     XPLMDrawTranslucentDarkBox(left, top, right, bottom);
 
     sprintf(buf, "Tile: %+3d,%+4d Active: %2d      Now:  %7.1f", current_tile.south, current_tile.west, active_n, now);
     XPLMDrawString(color, left + 5, top - 10, buf, 0, xplmFont_Basic);
-    sprintf(buf, "View: %10.3f,%10.3f,%10.3f %6.1f\xC2\xB0", XPLMGetDataf(ref_view_x), XPLMGetDataf(ref_view_y), XPLMGetDataf(ref_view_z), XPLMGetDataf(ref_view_h));
+    sprintf(buf, "View: %10.3f,%10.3f,%10.3f %6.1f\xC2\xB0", (double) input.view_x, (double) input.view_y, (double) input.view_z, (double) input.view_h);
     XPLMDrawString(color, left + 5, top - 20, buf, 0, xplmFont_Basic);
     width=XPLMMeasureString(xplmFont_Basic, buf, strlen(buf));
-    sprintf(buf, "Draw: %4d Max: %4d", drawtime, drawmax);
+    perf_stats(perf_update, &update, &update_avg, &update_max);
+    sprintf(buf, "Update: %4.0f Max: %4.0f Cost: %4.0f/%4d Limit: %4d", (double) update, (double) update_max, frame_cost_avg, frame_budget, active_max);
     XPLMDrawString(color, left + 5, top - 30, buf, 0, xplmFont_Basic);
-    top-=40;
+    models_stats(&prefetched, &early, &late);
+    models_objects(&loaded, &evicted);
+    sprintf(buf, "Models: prefetched %d, ready %d early %d late, loaded %d evicted %d", prefetched, early, late, loaded, evicted);
+    XPLMDrawString(color, left + 5, top - 40, buf, 0, xplmFont_Basic);
+    strcpy(buf, "Memory [KB]:");
+    for (i=0; i<mem_kind_count; i++)
+    {
+        static const char *mem_labels[mem_kind_count] = { "Path", "Name", "Tile", "Cand", "Actv", "Modl", "Map" };
+        int allocs, bytes;
+        mem_stats(i, &allocs, &bytes);
+        sprintf(buf+strlen(buf), " %s %d", mem_labels[i], (bytes+1023)/1024);
+    }
+    XPLMDrawString(color, left + 5, top - 50, buf, 0, xplmFont_Basic);
+    top-=60;
 
     while (a!=NULL)
     {
-        sprintf(buf, "%s: %s", ships[a->route->ship_kind].token, a->route->name);
+        sprintf(buf, "%s: %s", ships[a->route->ship_kind].token, route_name(a->route));
         XPLMDrawString(color, left + 5, top - 10, buf, 0, xplmFont_Basic);
         width1=XPLMMeasureString(xplmFont_Basic, buf, strlen(buf));
         if (width1>width) { width=width1; }
@@ -650,8 +1476,75 @@ static void drawdebug(XPLMWindowID inWindowID, void *inRefcon)
 #endif	/* DO_ACTIVE_LIST */
 
 
+/* Dataref accessors */
+static int getdatai(void *inRefcon)
+{
+    return *(int*) inRefcon;
+}
+
+static float getcost(void *inRefcon)
+{
+    return (float) frame_cost_avg;
+}
+
+static void setbudget(void *inRefcon, int inValue)
+{
+    frame_budget = inValue > 0 ? inValue : 0;
+    if (!frame_budget && active_max != active_base)
+    {
+        active_max = active_base;	/* Revert to rendering options */
+        need_recalc = 1;
+    }
+}
+
+
+/* Weights for picking routes. Negative weights count as zero. */
+static int getweights(void *inRefcon, float *outValues, int inOffset, int inMax)
+{
+    int i;
+    if (!outValues) { return ship_kind_count; }
+    for (i=0; i<inMax && inOffset+i<ship_kind_count; i++)
+        outValues[i] = kind_weights[inOffset+i];
+    return i;
+}
+
+static void setweights(void *inRefcon, float *inValues, int inOffset, int inCount)
+{
+    int i;
+    for (i=0; i<inCount && inOffset+i<ship_kind_count; i++)
+        kind_weights[inOffset+i] = inValues[i] > 0 ? inValues[i] : 0;
+    hood_valid = 0;
+    need_recalc = 1;
+}
+
+static float getexponent(void *inRefcon)
+{
+    return length_exponent;
+}
+
+static void setexponent(void *inRefcon, float inValue)
+{
+    length_exponent = inValue;
+    hood_valid = 0;
+    need_recalc = 1;
+}
+
+static void setradius(void *inRefcon, int inValue)
+{
+    if (inValue < RENDER_RADIUS_MIN) { inValue = RENDER_RADIUS_MIN; }
+    else if (inValue > RENDER_RADIUS_MAX) { inValue = RENDER_RADIUS_MAX; }
+    if (inValue != render_radius)
+    {
+        render_radius = inValue;
+        need_recalc = 1;
+    }
+}
+
 static void menuhandler(void *inMenuRef, void *inItemRef)
 {
+    char path[PATH_MAX];
+    unsigned int seed;
+
     switch ((intptr_t) inItemRef)
     {
 #ifdef DO_LOCAL_MAP
@@ -660,6 +1553,10 @@ static void menuhandler(void *inMenuRef, void *inItemRef)
         XPLMCheckMenuItem(my_menu_id, menu_idx_local_map, do_local_map ? xplm_Menu_Checked : xplm_Menu_Unchecked);
         if (do_local_map)
         {
+            active_route_t *a;
+            for (a=active_routes; a; a=a->next)
+                route_loadname(a->route);	/* Ships started since the map was last on */
+            mapflush();
             XPLMRegisterDrawCallback(drawmap3d, xplm_Phase_LocalMap3D, 0, NULL);
             XPLMRegisterDrawCallback(drawmap2d, xplm_Phase_LocalMap2D, 0, NULL);
         }
@@ -667,9 +1564,70 @@ static void menuhandler(void *inMenuRef, void *inItemRef)
         {
             XPLMUnregisterDrawCallback(drawmap3d, xplm_Phase_LocalMap3D, 0, NULL);
             XPLMUnregisterDrawCallback(drawmap2d, xplm_Phase_LocalMap2D, 0, NULL);
+            mapflush();
+#ifndef DO_ACTIVE_LIST
+            routes_freenames();	/* Nothing else uses them */
+#endif
         }
         break;
 #endif
+
+    case menu_idx_trace:
+        do_trace=perf_trace(!do_trace);
+        XPLMCheckMenuItem(my_menu_id, menu_idx_trace, do_trace ? xplm_Menu_Checked : xplm_Menu_Unchecked);
+        break;
+
+    case menu_idx_dump:
+        xplanepath(path, "");
+        perf_dump(path);
+        break;
+
+    case menu_idx_record:
+        if (do_record)
+        {
+            record_stop();
+            do_record = 0;
+        }
+        else if (!do_replay)
+        {
+            seed = (unsigned int) time(NULL);
+            xplanepath(path, INPUT_RECORDING);
+            if ((do_record = record_start(path, seed)))
+                restart(seed);
+        }
+        XPLMCheckMenuItem(my_menu_id, menu_idx_record, do_record ? xplm_Menu_Checked : xplm_Menu_Unchecked);
+        break;
+
+    case menu_idx_replay:
+        if (do_replay)
+            replayend();
+        else
+        {
+            if (do_record)
+            {
+                record_stop();
+                do_record = 0;
+                XPLMCheckMenuItem(my_menu_id, menu_idx_record, xplm_Menu_Unchecked);
+            }
+            xplanepath(path, INPUT_RECORDING);
+            if ((do_replay = replay_start(path, &seed)))
+                restart(seed);
+            XPLMCheckMenuItem(my_menu_id, menu_idx_replay, do_replay ? xplm_Menu_Checked : xplm_Menu_Unchecked);
+        }
+        break;
+
+    case menu_idx_export:
+        if (do_export)
+        {
+            export_stop();
+            do_export = 0;
+        }
+        else
+        {
+            do_export = export_start();
+        }
+        XPLMCheckMenuItem(my_menu_id, menu_idx_export, do_export ? xplm_Menu_Checked : xplm_Menu_Unchecked);
+        break;
     }
 }
 
@@ -692,7 +1650,7 @@ static int failinit(char *outDescription)
 
 
 /* Convert path to posix style in-place */
-static void posixify(char *path)
+void posixify(char *path)
 {
 #if APL
     if (*path!='/')
@@ -722,6 +1680,10 @@ static void posixify(char *path)
 PLUGIN_API int XPluginStart(char *outName, char *outSignature, char *outDescription)
 {
     char buffer[PATH_MAX], *c;
+    int i;
+
+    perf_init();
+    start_time = perf_time();
 
     sprintf(outName, "SeaTraffic v%.2f", VERSION);
     strcpy(outSignature, "Marginal.SeaTraffic");
@@ -748,17 +1710,18 @@ PLUGIN_API int XPluginStart(char *outName, char *outSignature, char *outDescript
     assert (!(strncmp(mypath, buffer, strlen(buffer))));
     relpath=mypath+strlen(buffer);			/* resource path, relative to X-Plane system folder */
 
+    /* Wakes and routes.txt are loaded in the background */
     strcpy(buffer, relpath);
     strcat(buffer, "wake_big.obj");
-    if (!(wake_big_ref=loadobject(buffer))) { return 0; }
+    if (!loadobjectasync(buffer, &wake_big_ref)) { return 0; }
     strcpy(buffer, relpath);
     strcat(buffer, "wake_med.obj");
-    if (!(wake_med_ref=loadobject(buffer))) { return 0; }
+    if (!loadobjectasync(buffer, &wake_med_ref)) { return 0; }
     strcpy(buffer, relpath);
     strcat(buffer, "wake_sml.obj");
-    if (!(wake_sml_ref=loadobject(buffer))) { return 0; }
+    if (!loadobjectasync(buffer, &wake_sml_ref)) { return 0; }
 
-    if (!readroutes(mypath, outDescription)) { return failinit(outDescription); }	/* read routes.txt */
+    if (!routes_load(mypath, outDescription)) { return failinit(outDescription); }
 
     ref_view_x   =XPLMFindDataRef("sim/graphics/view/view_x");
     ref_view_y   =XPLMFindDataRef("sim/graphics/view/view_y");
@@ -766,29 +1729,67 @@ PLUGIN_API int XPluginStart(char *outName, char *outSignature, char *outDescript
     ref_view_h   =XPLMFindDataRef("sim/graphics/view/view_heading");
     ref_plane_lat=XPLMFindDataRef("sim/flightmodel/position/latitude");
     ref_plane_lon=XPLMFindDataRef("sim/flightmodel/position/longitude");
+    ref_plane_gs =XPLMFindDataRef("sim/flightmodel/position/groundspeed");
+    ref_plane_track=XPLMFindDataRef("sim/flightmodel/position/hpath");
     ref_night    =XPLMFindDataRef("sim/graphics/scenery/percent_lights_on");
     ref_rentype  =XPLMFindDataRef("sim/graphics/view/world_render_type");
     ref_monotonic=XPLMFindDataRef("sim/time/total_running_time_sec");
-    if (!(ref_view_x && ref_view_y && ref_view_z && ref_view_h && ref_plane_lat && ref_plane_lon && ref_night && ref_rentype && ref_monotonic))
+    if (!(ref_view_x && ref_view_y && ref_view_z && ref_view_h && ref_plane_lat && ref_plane_lon && ref_plane_gs && ref_plane_track && ref_night && ref_rentype && ref_monotonic))
     {
         strcpy(outDescription, "Can't access X-Plane datarefs!");
         return failinit(outDescription);
     }
 
-    srand(time(NULL));	/* Seed rng */
+    ref_budget    =XPLMRegisterDataAccessor("marginal/seatraffic/frame_budget_us", xplmType_Int, 1, getdatai, setbudget, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &frame_budget, &frame_budget);
+    ref_render_radius=XPLMRegisterDataAccessor("marginal/seatraffic/render_radius_m", xplmType_Int, 1, getdatai, setradius, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &render_radius, &render_radius);
+    for (i=0; i<tier_count; i++)
+    {
+        char name[64];
+        sprintf(name, DATAREF_PREFIX "tier/%s_ships", tier_names[i]);
+        tier_refs[i]=XPLMRegisterDataAccessor(name, xplmType_Int, 0, getdatai, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, tier_n + i, NULL);
+    }
+    ref_kind_weights=XPLMRegisterDataAccessor("marginal/seatraffic/kind_weights", xplmType_FloatArray, 1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, getweights, setweights, NULL, NULL, NULL, NULL);
+    ref_length_exponent=XPLMRegisterDataAccessor("marginal/seatraffic/length_exponent", xplmType_Float, 1, NULL, NULL, getexponent, setexponent, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    ref_active_max=XPLMRegisterDataAccessor("marginal/seatraffic/active_max", xplmType_Int, 0, getdatai, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &active_max, NULL);
+    ref_frame_cost=XPLMRegisterDataAccessor("marginal/seatraffic/frame_cost_us", xplmType_Float, 0, NULL, NULL, getcost, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+
+    rng_seed((unsigned int) time(NULL));	/* Seed rng */
+
+    perf_register();
+    mem_register();
 
 #ifdef DO_ACTIVE_LIST
     windowId = XPLMCreateWindow(10, 750, 310, 650, 1, drawdebug, NULL, NULL, NULL);	/* size overridden later */
-# if IBM
-    QueryPerformanceFrequency((LARGE_INTEGER *) &ticks_per_sec);
-# endif
 #endif
 
+    sprintf(buffer, "SeaTraffic: Started in %.1fms\n", (perf_time() - start_time) / 1000.0);
+    XPLMDebugString(buffer);
     return 1;
 }
 
 PLUGIN_API void XPluginStop(void)
 {
+    int i;
+
+    routes_wait();
+#if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
+    routes_freenames();
+#endif
+    models_save();
+    XPLMUnregisterDataAccessor(ref_budget);
+    XPLMUnregisterDataAccessor(ref_render_radius);
+    for (i=0; i<tier_count; i++)
+        XPLMUnregisterDataAccessor(tier_refs[i]);
+    XPLMUnregisterDataAccessor(ref_kind_weights);
+    XPLMUnregisterDataAccessor(ref_length_exponent);
+    XPLMUnregisterDataAccessor(ref_active_max);
+    XPLMUnregisterDataAccessor(ref_frame_cost);
+    perf_unregister();
+    mem_unregister();
+    perf_trace(0);
+    record_stop();
+    replay_stop();
+    export_stop();
 #ifdef DO_ACTIVE_LIST
     if (windowId) { XPLMDestroyWindow(windowId); }
 #endif
@@ -804,14 +1805,20 @@ PLUGIN_API void XPluginDisable(void)
 
 PLUGIN_API void XPluginReceiveMessage(XPLMPluginID inFrom, long inMessage, void *inParam)
 {
+    if (query_message(inMessage, inParam)) { return; }	/* Another plugin asking about ships */
+
     if (!done_init)
     {
         int my_menu_index;
+        char buf[80];
+        double start = perf_time();
         done_init = 1;
 
         /* Load default ship .objs. Deferred to here so scenery library has been scanned */
         if (!models_init(relpath))
             return;	/* Exit before setting up menus & callbacks */
+        sprintf(buf, "SeaTraffic: Initialised models in %.1fms\n", (perf_time() - start) / 1000.0);
+        XPLMDebugString(buf);
 
         /* Finish setup */
         ref_renopt = XPLMFindDataRef("sim/private/controls/reno/draw_objs_06");	/* v10+ */
@@ -827,21 +1834,27 @@ PLUGIN_API void XPluginReceiveMessage(XPLMPluginID inFrom, long inMessage, void
         XPLMCheckMenuItem(my_menu_id, menu_idx_local_map, do_local_map ? xplm_Menu_Checked : xplm_Menu_Unchecked);
         if (do_local_map)
         {
+            mapflush();
             XPLMRegisterDrawCallback(drawmap3d, xplm_Phase_LocalMap3D, 0, NULL);
             XPLMRegisterDrawCallback(drawmap2d, xplm_Phase_LocalMap2D, 0, NULL);
         }
+#endif
+        /* Timings */
+        XPLMAppendMenuItem(my_menu_id, "Record frame trace", (void*) menu_idx_trace, 0);
+        XPLMCheckMenuItem(my_menu_id, menu_idx_trace, xplm_Menu_Unchecked);
+        XPLMAppendMenuItem(my_menu_id, "Save frame timings", (void*) menu_idx_dump, 0);
+        XPLMAppendMenuItem(my_menu_id, "Record inputs", (void*) menu_idx_record, 0);
+        XPLMCheckMenuItem(my_menu_id, menu_idx_record, xplm_Menu_Unchecked);
+        XPLMAppendMenuItem(my_menu_id, "Replay inputs", (void*) menu_idx_replay, 0);
+        XPLMCheckMenuItem(my_menu_id, menu_idx_replay, xplm_Menu_Unchecked);
+        XPLMAppendMenuItem(my_menu_id, "Export ships to shared memory", (void*) menu_idx_export, 0);
+        XPLMCheckMenuItem(my_menu_id, menu_idx_export, xplm_Menu_Unchecked);
+#if IBM
+        XPLMEnableMenuItem(my_menu_id, menu_idx_export, 0);	/* POSIX only */
 #endif
         need_recalc = 1;
     }
 
-    if (ref_renopt)		/* change to rendering options causes SCENERY_LOADED */
-    {
-        int new_active_max = XPLMGetDatai(ref_renopt) * RENDERING_SCALE;
-        if (new_active_max > ACTIVE_MAX) { new_active_max = ACTIVE_MAX; }
-        if (active_max != new_active_max)
-        {
-            active_max = new_active_max;
-            need_recalc = 1;
-        }
-    }
+    if (ref_renopt && !do_replay)	/* change to rendering options causes SCENERY_LOADED */
+        setactivebase(XPLMGetDatai(ref_renopt));
 }
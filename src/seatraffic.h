@@ -22,6 +22,7 @@
 #include <ctype.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #define XPLM200	/* Requires X-Plane 9.0 or later */
 #define XPLM210	/* Uses asynchronous object loading if on v10 */
@@ -34,12 +35,12 @@
 #include "XPLMUtilities.h"
 #include "XPUIGraphics.h"
 
+#include "geodesy.h"
+
 #if APL
 #  include <OpenGL/gl.h>
-#  include <OpenGL/glu.h>
 #else
 #  include <GL/gl.h>
-#  include <GL/glu.h>
 #endif
 
 #ifdef _MSC_VER
@@ -58,24 +59,62 @@
 #define DRAW_WAKE     12000.f
 #define RENDERING_SCALE 16	/* multiplied by number of objects setting to give maximum number of active routes */
 #define ACTIVE_DEFAULT  (2*RENDERING_SCALE)	/* for v9 */
-#define ACTIVE_MAX      (4*RENDERING_SCALE)	/* "mega tons" */
-#define TILE_RANGE 1		/* How many tiles away from plane's tile to render boats */
+#define ACTIVE_FIXED_MAX (4*RENDERING_SCALE)	/* "mega tons" - limit if not adapting to frame cost */
+#define ACTIVE_MIN      (RENDERING_SCALE/4)	/* Limits when adapting to frame cost */
+#define ACTIVE_MAX      1024
+#define FRAME_BUDGET    0	/* Default target for our own per-frame cost, or 0 for a fixed number of ships [us] */
+#define BUDGET_INTERVAL 1.0f	/* How often to re-assess the number of active routes against the frame budget [s] */
+#define BUDGET_STEP     0.1f	/* Maximum proportion of active routes to add or retire per BUDGET_INTERVAL */
+#define BUDGET_SMOOTHING 0.05	/* Weight given to each new frame in the smoothed frame cost */
+#define PERF_SMOOTHING 0.05f	/* Weight given to each new frame in the smoothed phase timings */
+#define PERF_WINDOW 10.0	/* Period over which the maximum phase timings are taken [s] */
+#define PERF_HIST_SUB 8		/* Histogram buckets per power of two */
+#define PERF_HIST_MAX 176	/* Number of histogram buckets, enough for 2^24us */
+#define PERF_TRACE_MAX 4096	/* Number of frames kept in the trace */
+#define QUERY_CELL_MIN 500.0	/* Smallest cell in the grid used to answer other plugins' queries [m] */
+#define QUERY_CELLS_MAX (2*ACTIVE_MAX)	/* Most cells in that grid */
+#define INPUT_RECORDING "SeaTraffic-inputs.bin"	/* Recorded simulator inputs, in the X-Plane folder */
+#define TILE_RANGE 1		/* How many tiles away from plane's tile to draw routes in the local map */
+#define RENDER_RADIUS 100000	/* Default distance from the plane within which to simulate ships [m] */
+#define RENDER_RADIUS_MIN 10000
+#define RENDER_RADIUS_MAX 500000
+#define RECALC_DISTANCE 0.25f	/* Look for new routes when the plane has moved this proportion of the render radius */
+#define PATH_QUANTUM 1e-6	/* Resolution of stored route paths [degrees] */
+#define GREAT_CIRCLE_STEP 50000.f	/* Follow long route segments in steps of this length when testing which tiles and ranges they pass through [m] */
+#define SUPERBLOCK 8		/* Tiles are grouped into SUPERBLOCKxSUPERBLOCK superblocks so that empty areas can be skipped */
+#define PREFETCH_TIME 600.f	/* Start loading models for tiles that the plane will reach in this time [s] */
+#define PREFETCH_MAX 200000.f	/* but don't look further ahead than this [m] */
+#define EVICT_TIME 900.f	/* Unload custom models for tiles that have been out of range and unused for this long [s] */
 #define OBJ_VARIANT_MAX 8	/* How many physical objects to use for each virtual object in X-Plane's library */
+#define TIER_NEAR 3000.f	/* Update ships nearer the viewer than this every frame [m] */
+#define TIER_MID DRAW_WAKE	/* Update ships nearer than this every TIER_MID_INTERVAL frames, and further every TIER_FAR_INTERVAL */
+#define TIER_MID_INTERVAL 4	/* must be a power of two */
+#define TIER_FAR_INTERVAL 16	/* must be a power of two */
 #define HDG_HOLD_TIME 10.0f	/* Only update headings and altitudes periodically [s] */
 #define LINGER_TIME 300.0f	/* How long should ships hang around at the dock at the end of their route [s] */
 #define SHIP_SPACING 8		/* Try to space ships out by this many times their semilen */
-#define RADIUS 6378145.f	/* from sim/physics/earth_radius_m [m] */
+#define SPAWN_RADIUS 0.9f	/* Start new ships within this proportion of the render radius */
+#define SPAWN_TRIES 4		/* Number of random places along a route to try when starting a ship */
+#define SAMPLE_TRIES 8		/* Number of picks of routes that are already active before falling back to a linear scan */
 #define WAKE_MINSPEED 5		/* Only draw wakes for ships going this fast [m/s] */
 #define WAKE_MED 20		/* Draw medium wake for ships this large (semilen) [m] */
 #define WAKE_BIG 40		/* Draw large  wake for ships this large (semilen) [m] */
 #define LIBRARY_PREFIX "marginal/seatraffic/"	/* library names */
+#define DATAREF_PREFIX "marginal/seatraffic/"	/* our datarefs */
 #define LIBRARY_TOKEN_MAX 8 	/* token size */
+#define LIBRARY_CACHE "SeaTraffic.cache"	/* Results of library lookups, in X-Plane's preferences folder */
+#define LIBRARY_CACHE_VERSION 1
 
 /* rendering options */
 #define DO_LOCAL_MAP
 enum
 {
-    menu_idx_local_map
+    menu_idx_local_map,
+    menu_idx_trace,
+    menu_idx_dump,
+    menu_idx_record,
+    menu_idx_replay,
+    menu_idx_export
 } menu_idx;
 #ifdef DEBUG
 #  define DO_ACTIVE_LIST
@@ -98,25 +137,47 @@ typedef struct
     char token[LIBRARY_TOKEN_MAX];		/* token in routes.txt */
 } ship_t;
 
-/* Models of a kind of ship */
+/* Simulator state that drives the plugin, sampled once per frame and recorded and replayed by replay.c - apart from
+ * rentype, which is sampled for each draw callback */
 typedef struct
 {
-    int obj_n;					/* Number of physical .objs */
-    char **names;				/* Physical .obj names for sorting */
-    XPLMObjectRef *refs;			/* Physical .obj handles */
-} ship_models_t;
+    double plane_lat, plane_lon;
+    float plane_gs, plane_track;
+    float view_x, view_y, view_z, view_h;
+    float night;
+    float monotonic;		/* sim/time/total_running_time_sec */
+    int rentype;		/* sim/graphics/view/world_render_type */
+    int renopt;			/* sim/private/controls/reno/draw_objs_06, or -1 if not available */
+} sim_input_t;
 
-/* Geolocation, used for route paths */
-typedef struct
+/* Phases of our work timed by perf.c */
+typedef enum
+{
+    perf_recalc, perf_update, perf_probe, perf_local, perf_reflect, perf_shadow, perf_base,
+    perf_phase_count
+} perf_phase_t;
+
+/* Update rate tiers, by distance from the viewer */
+typedef enum
 {
-    float lat, lon;	/* we don't need double precision so save some memory */
-} loc_t;
+    tier_near, tier_mid, tier_far,
+    tier_count
+} tier_t;
 
-/* Current location */
+/* Subsystems for memory accounting by mem.c */
+typedef enum
+{
+    mem_paths, mem_names, mem_tiles, mem_candidates, mem_active, mem_models, mem_map,
+    mem_kind_count
+} mem_kind_t;
+
+/* Models of a kind of ship */
 typedef struct
 {
-    double lat, lon;	/* we do want double precision to prevent jerkiness */
-} dloc_t;
+    int obj_n;					/* Number of physical .objs */
+    int *ids;					/* Physical .obj model ids for grouping draws */
+    XPLMObjectRef *refs;			/* Physical .obj handles */
+} ship_models_t;
 
 /* X-Plane 1x1degree tile number */
 typedef struct
@@ -124,15 +185,33 @@ typedef struct
     int south, west;
 } tile_t;
 
+/* Models of all kinds of ship for a tile */
+typedef struct tile_models_t
+{
+    struct tile_models_t *next;		/* List of custom sets */
+    ship_models_t models[ship_kind_count];
+    tile_t tile;
+    int pending;			/* Number of asynchronous loads outstanding */
+    int users;				/* Number of active routes using these models */
+    double requested, needed, ready;	/* When loading started, when a ship first needed it, and when it finished [us] */
+    double unused;			/* When it was last found to be unused and out of range [us] */
+} tile_models_t;
+
 /* A route from routes.txt */
 typedef struct
 {
-    loc_t *path;
+    int *segs;			/* Shared segments that make up the path - see routes.c */
+    loc_t *path;		/* Decoded path, only while path_users is non-zero */
 #if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
-    char *name;
+    int name_pos;		/* Offset of the route's header line in routes.txt */
+    int name_idx;		/* Offset+1 of the route's name in the name pool, or 0 if not yet read - see route_loadname() */
 #endif
+    float length;		/* [m] */
     ship_kind_t ship_kind;
     unsigned short pathlen;
+    unsigned short seg_n;
+    unsigned short path_users;	/* Number of users of path */
+    unsigned short mark;	/* Used by recalc() to avoid considering a route more than once */
 } route_t;
 
 /* List of routes */
@@ -153,8 +232,17 @@ typedef struct active_route_t
     int new_node;		/* Flag indicating that state needs updating after hitting a new node */
     float last_hdg;		/* The heading we set off from last_node */
     float last_time, next_time;	/* Time we left last_node, expected time to hit the next node */
+    int heap_idx;		/* Position in the event queue, which is keyed on next_time */
+    float *cumdist;		/* Cumulative distance along the route's path to each node [m] */
+    tier_t tier;		/* How often to update it */
+    unsigned char tick_phase;	/* Which frame out of every tier_interval to update it on */
+    float tick_time;		/* When its location was last updated */
+    float local_x, local_z;	/* Local co-ordinates at tick_time, */
+    float vel_x, vel_z;		/* and velocity for extrapolation [m/s] */
+    unsigned int id;		/* Unique identifier for external tools */
+    tile_models_t *tile_models;	/* Set of models that the object comes from */
     XPLMObjectRef *object_ref;	/* X-Plane object */
-    const char *object_name;	/* X-Plane object name for sorting */
+    int model_id;		/* X-Plane object's model id for grouping draws */
     dloc_t loc;			/* Ship's current location */
     double altmsl;		/* Altitude */
     XPLMProbeRef ref_probe;	/* Terrain probe */
@@ -164,6 +252,16 @@ typedef struct active_route_t
 #endif
 } active_route_t;
 
+#ifdef DO_LOCAL_MAP
+/* Route polylines for one tile in the local map, cached in local co-ordinates */
+typedef struct
+{
+    tile_t tile;
+    float *verts;		/* x,y,z vertex pairs for GL_LINES */
+    int vert_n;
+} map_tile_t;
+#endif
+
 
 /* globals */
 extern const ship_t ships[ship_kind_count];
@@ -171,21 +269,88 @@ extern const ship_t ships[ship_kind_count];
 
 /* prototypes */
 int readroutes(char *mypath, char *err);
+int routes_load(char *mypath, char *err);
+int routes_poll(char *err, double *elapsed, int *count);
+void routes_wait(void);
 route_list_t *getroutesbytile(int south, int west);
+int getroutecountbyblock(int south, int west);
+void routes_clearmarks(void);
+void routes_summary(void);
+int route_anysegment(route_t *route, int (*fn)(loc_t, loc_t));
+loc_t *route_acquire(route_t *route);
+void route_release(route_t *route);
+#if defined(DO_LOCAL_MAP) || defined(DO_ACTIVE_LIST)
+int route_loadname(route_t *route);
+const char *route_name(const route_t *route);
+void routes_freenames(void);
+#endif
 
-route_list_t *route_list_add(route_list_t **route_list, route_t *route);
+route_list_t *route_list_add(route_list_t **route_list, route_t *route, mem_kind_t kind);
 route_list_t *route_list_get_byroute(route_list_t *route_list, route_t *route);
-route_t *route_list_pop(route_list_t **route_list, int n);
+route_t *route_list_pop(route_list_t **route_list, int n, mem_kind_t kind);
 int route_list_length(route_list_t *route_list);
-void route_list_free(route_list_t **route_list);
+void route_list_free(route_list_t **route_list, mem_kind_t kind);
 
-active_route_t *active_route_add(active_route_t **active_routes);
+void active_route_add(active_route_t **active_routes, active_route_t *newroute);
 active_route_t *active_route_get(active_route_t *active_routes, int n);
 active_route_t *active_route_get_byroute(active_route_t *active_routes, route_t *route);
 void active_route_pop(active_route_t **active_routes, int n);
 int active_route_length(active_route_t *active_routes);
-void active_route_sort(active_route_t **active_routes, int active_n);
+
+int event_add(active_route_t *a);
+void event_remove(active_route_t *a);
+void event_update(active_route_t *a);
+active_route_t *event_due(float now);
+
+void perf_init(void);
+double perf_time(void);
+double perf_add(perf_phase_t phase, double start);
+double perf_add_nested(perf_phase_t phase, perf_phase_t outer, double start);
+void perf_count(perf_phase_t phase, int n);
+void perf_frame(int active_n);
+int perf_trace(int enable);
+void perf_dump(const char *dir);
+void perf_stats(perf_phase_t phase, float *last, float *avg, float *max);
+void perf_register(void);
+void perf_unregister(void);
+
+void mem_add(mem_kind_t kind, int allocs, int bytes);
+void mem_stats(mem_kind_t kind, int *allocs, int *bytes);
+void mem_summary(void);
+void mem_register(void);
+void mem_unregister(void);
+
+int record_start(const char *path, unsigned int seed);
+void record_input(const sim_input_t *input);
+void record_stop(void);
+int replay_start(const char *path, unsigned int *seed);
+int replay_input(sim_input_t *input);
+void replay_stop(void);
+
+int export_start(void);
+void export_frame(active_route_t *active_routes, float now);
+void export_stop(void);
+
+void query_frame(active_route_t *active_routes);
+int query_message(long inMessage, void *inParam);
+
+void rng_seed(unsigned int seed);
+unsigned int rng_next(void);
+int rng_below(int n);
+float rng_float(void);
+int sample_build(const float *weights, int n);
+int sample_pick(void);
 
 int models_init();
-ship_models_t *models_for_tile(int south, int west);
+int models_failed(void);
+tile_models_t *models_for_tile(int south, int west);
+void models_release(tile_models_t *tile_models);
+int models_prefetch(int south, int west);
+void models_evict(tile_t current_tile, int range);
+void models_stats(int *prefetched, int *early, int *late);
+void models_objects(int *loaded, int *evicted);
+void models_save(void);
 XPLMObjectRef loadobject(const char *path);
+int loadobjectasync(const char *path, XPLMObjectRef *ref);
+
+void posixify(char *path);
@@ -0,0 +1,102 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Command-line reader for the plugin's shared memory export, for testing. Not part of the plugin.
+ *
+ * Build: cc -O2 -o stexport stexport.c -lrt	(omit -lrt on Mac)
+ * Usage: stexport [-f frames] [-i interval_ms] [-n ships]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "export.h"
+
+static const char *kinds[] = { "leisure", "tourist", "cruise", "ped/sml", "ped/med", "veh/sml", "veh/med", "veh/big", "cargo", "tanker" };
+
+
+int main(int argc, char **argv)
+{
+    int fd, c, frames = 0, interval = 1000, show = 10, retries = 0;
+    struct stat st;
+    export_header_t *header;
+    export_frame_t frame;
+    export_ship_t *ships;
+    unsigned int i, last_frame = 0;
+
+    while ((c = getopt(argc, argv, "f:i:n:")) != -1)
+        switch (c)
+        {
+        case 'f': frames = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 'n': show = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f frames] [-i interval_ms] [-n ships]\n", argv[0]);
+            return 2;
+        }
+
+    if ((fd = shm_open(EXPORT_NAME, O_RDONLY, 0)) < 0 || fstat(fd, &st) ||
+        (header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        perror("Can't open " EXPORT_NAME " - is SeaTraffic's export turned on?");
+        return 1;
+    }
+    close(fd);
+    if (st.st_size < (off_t) sizeof(export_header_t) || memcmp(header->magic, EXPORT_MAGIC, sizeof(header->magic)) ||
+        header->version != EXPORT_VERSION || st.st_size < (off_t) EXPORT_SIZE(header->capacity))
+    {
+        fprintf(stderr, "Unrecognised " EXPORT_NAME "\n");
+        return 1;
+    }
+    if (!(ships = malloc(header->capacity * sizeof(export_ship_t))))
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    while (1)
+    {
+        /* Seqlock read of the latest frame */
+        export_frame_t *slot = EXPORT_FRAME(header, header->latest);
+        unsigned int seq = slot->seq;
+        if (seq & 1)
+        {
+            retries++;
+            continue;
+        }
+        __sync_synchronize();
+        frame = *slot;
+        if (frame.ship_n > header->capacity) { frame.ship_n = header->capacity; }
+        memcpy(ships, EXPORT_SHIPS(header, slot), frame.ship_n * sizeof(export_ship_t));
+        __sync_synchronize();
+        if (slot->seq != seq)
+        {
+            retries++;
+            continue;
+        }
+
+        if (frame.frame != last_frame)
+        {
+            printf("Frame %u, time %.2fs, %u ships, %d retries\n", frame.frame, frame.sim_time, frame.ship_n, retries);
+            for (i=0; i<frame.ship_n && i<(unsigned int) show; i++)
+                printf("  %6u %-8s %11.6f %11.6f %6.1fm %5.1f\xC2\xB0 %4.1fm/s\n", ships[i].id,
+                       ships[i].kind < sizeof(kinds)/sizeof(kinds[0]) ? kinds[ships[i].kind] : "?",
+                       ships[i].lat, ships[i].lon, ships[i].alt, ships[i].heading, ships[i].speed);
+            last_frame = frame.frame;
+            retries = 0;
+            if (frames && !--frames) { break; }
+        }
+        usleep(interval * 1000);
+    }
+
+    free(ships);
+    munmap(header, st.st_size);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Benchmark and accuracy check for the geodesy in geodesy.h. Not part of the plugin.
+ * Built by "make tools" with the same optimisation and floating point options as the plugin, so that the timings
+ * reflect the code that runs in flight.
+ *
+ * Usage: stgeodesy [segments]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "geodesy.h"
+
+#define GEODESY_CHECK_N 2000000	/* Default number of random segments */
+
+
+/* Double-precision references for the kernels, on the same sphere. Inputs and outputs in radians or metres. */
+static double refdistance(double lat1, double lon1, double lat2, double lon2)
+{
+    double slat=sin((lat2-lat1)/2);
+    double slon=sin((lon2-lon1)/2);
+    double aa=slat*slat + cos(lat1) * cos(lat2) * slon*slon;
+    return (double) RADIUS*2 * atan2(sqrt(aa), sqrt(1-aa));
+}
+
+static double refheading(double lat1, double lon1, double lat2, double lon2)
+{
+    return atan2(sin(lon2-lon1)*cos(lat2), cos(lat1)*sin(lat2)-sin(lat1)*cos(lat2)*cos(lon2-lon1));
+}
+
+/* Exact destination, unlike displaced() which assumes a short distance */
+static void refdisplaced(double lat1, double lon1, double h, double d, double *lat2, double *lon2)
+{
+    double dang=d/(double)RADIUS;
+    *lat2=asin(sin(lat1)*cos(dang) + cos(lat1)*sin(dang)*cos(h));
+    *lon2=lon1 + atan2(sin(h)*sin(dang)*cos(lat1), cos(dang)-sin(lat1)*sin(*lat2));
+}
+
+static double benchrand(unsigned int *state, double lo, double hi)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return lo + (hi-lo) * (*state / 4294967296.0);
+}
+
+/* Angle between two headings [degrees] */
+static double headingerror(double h1, double h2)
+{
+    double e=fmod(fabs(h1-h2), M_PI*2);
+    return (e > M_PI ? M_PI*2 - e : e) * (180*M_1_PI);
+}
+
+/* [us] */
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+
+/* Time distanceto(), headingto() and displaced() over random segments of typical route lengths, and report their worst
+ * errors against the double-precision references. */
+int main(int argc, char **argv)
+{
+    loc_t *a, *b;
+    double *h, *d;
+    unsigned int state=0x5ea7aff1;
+    double t, t_dist, t_hdg, t_disp, t_ref;
+    double err_dist=0, err_rel=0, err_hdg=0, err_disp=0;
+    volatile double sink=0;	/* Stop the timed loops being optimised away */
+    int i, n = argc > 1 ? atoi(argv[1]) : GEODESY_CHECK_N;
+
+    if (argc > 2 || n <= 0)
+    {
+        fprintf(stderr, "Usage: %s [segments]\n", argv[0]);
+        return 2;
+    }
+    if (!(a=malloc(n*sizeof(loc_t))) || !(b=malloc(n*sizeof(loc_t))) || !(h=malloc(n*sizeof(double))) || !(d=malloc(n*sizeof(double))))
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    /* Segments from 10m to 200km, log-uniformly distributed, away from the poles like the routes */
+    for (i=0; i<n; i++)
+    {
+        double lat2, lon2;
+        a[i].lat=(float) benchrand(&state, -75, 75);
+        a[i].lon=(float) benchrand(&state, -180, 180);
+        h[i]=benchrand(&state, -M_PI, M_PI);
+        d[i]=exp(benchrand(&state, log(10.0), log(200000.0)));
+        refdisplaced((double) a[i].lat * (M_PI/180), (double) a[i].lon * (M_PI/180), h[i], d[i], &lat2, &lon2);
+        b[i].lat=(float) (lat2 * (180*M_1_PI));
+        b[i].lon=(float) (lon2 * (180*M_1_PI));
+    }
+
+    /* Speed */
+    t=now();
+    for (i=0; i<n; i++)
+        sink+=(double) distanceto(a[i], b[i]);
+    t_dist=now()-t;
+    t=now();
+    for (i=0; i<n; i++)
+        sink+=(double) headingto(a[i], b[i]);
+    t_hdg=now()-t;
+    t=now();
+    for (i=0; i<n; i++)
+    {
+        dloc_t loc;
+        displaced(a[i], h[i], d[i], &loc);
+        sink+=loc.lat;
+    }
+    t_disp=now()-t;
+    t=now();
+    for (i=0; i<n; i++)
+        sink+=refdistance((double) a[i].lat * (M_PI/180), (double) a[i].lon * (M_PI/180), (double) b[i].lat * (M_PI/180), (double) b[i].lon * (M_PI/180));
+    t_ref=now()-t;
+
+    /* Accuracy, against the references given the same inputs */
+    for (i=0; i<n; i++)
+    {
+        double lat1=(double) a[i].lat * (M_PI/180), lon1=(double) a[i].lon * (M_PI/180);
+        double lat2=(double) b[i].lat * (M_PI/180), lon2=(double) b[i].lon * (M_PI/180);
+        double ref=refdistance(lat1, lon1, lat2, lon2);
+        double e=fabs((double) distanceto(a[i], b[i]) - ref);
+        dloc_t loc;
+
+        if (e > err_dist) { err_dist=e; }
+        if (e/ref > err_rel) { err_rel=e/ref; }
+        if (ref >= 100 && (e=headingerror((double) headingto(a[i], b[i]), refheading(lat1, lon1, lat2, lon2))) > err_hdg) { err_hdg=e; }	/* heading is ill-conditioned for very short segments */
+
+        displaced(a[i], h[i], d[i], &loc);
+        refdisplaced(lat1, lon1, h[i], d[i], &lat2, &lon2);
+        if ((e=refdistance(loc.lat * (M_PI/180), loc.lon * (M_PI/180), lat2, lon2)) > err_disp) { err_disp=e; }
+    }
+
+    printf("Geodesy over %d segments: distanceto %.1fns, headingto %.1fns, displaced %.1fns, double reference distance %.1fns per call\n",
+           n, t_dist*1000/n, t_hdg*1000/n, t_disp*1000/n, t_ref*1000/n);
+    printf("Geodesy max error: distanceto %.3fm (%.2e relative), headingto %.4f degrees (segments >=100m), displaced %.3fm\n",
+           err_dist, err_rel, err_hdg, err_disp);
+
+    free(a);
+    free(b);
+    free(h);
+    free(d);
+    return 0;
+}
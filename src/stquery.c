@@ -0,0 +1,152 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Benchmark and correctness check for the grid that answers other plugins' queries. Not part of the plugin.
+ * Built by "make tools" with the same optimisation and floating point options as the plugin, so that the timings
+ * reflect the code that runs in flight. The grid's internals are static, so query.c is included rather than linked.
+ *
+ * Usage: stquery [queries]
+ */
+
+#include "query.c"
+
+#include <sys/time.h>
+
+#define QUERY_BENCH_N 100000	/* Default number of random queries per ship count */
+#define QUERY_BENCH_MIN 16	/* Smallest ship count - multiplied by 4 up to ACTIVE_MAX */
+#define QUERY_BENCH_K 8		/* Number of nearest ships */
+#define QUERY_BENCH_RADIUS 5000.0	/* Search radius [m] */
+
+
+static double benchrand(unsigned int *state, double lo, double hi)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return lo + (hi-lo) * (*state / 4294967296.0);
+}
+
+/* [us] */
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/* Brute force equivalents of the queries, for comparison */
+static int linearradius(double lat, double lon, double radius, int *count)
+{
+    double coslat = cos(lat * (M_PI/180));
+    int i, found=0;
+
+    lon = lonwrap(lon - grid_lon);
+    for (i=0; i<entry_n; i++)
+        if (querydistance2(lat, lon, coslat, entries+i) <= radius * radius) { found++; }
+    *count = found;
+    return found;
+}
+
+static int linearnearest(double lat, double lon, query_ship_t *ships, int k)
+{
+    double coslat = cos(lat * (M_PI/180));
+    int i, count=0;
+
+    lon = lonwrap(lon - grid_lon);
+    for (i=0; i<entry_n; i++)
+        nearestadd(ships, k, &count, entries+i, sqrt(querydistance2(lat, lon, coslat, entries+i)));
+    return count;
+}
+
+
+/* Time the queries against a brute force scan, for increasing numbers of ships scattered around random locations */
+int main(int argc, char **argv)
+{
+    static query_ship_t near[QUERY_BENCH_K], check[QUERY_BENCH_K];
+    unsigned int state=0x5ea7aff1;
+    int n, i, j, count, mismatches=0, queries = argc > 1 ? atoi(argv[1]) : QUERY_BENCH_N;
+    double *qlat, *qlon;
+
+    if (argc > 2 || queries <= 0)
+    {
+        fprintf(stderr, "Usage: %s [queries]\n", argv[0]);
+        return 2;
+    }
+    if (!(qlat=malloc(queries*sizeof(double))) || !(qlon=malloc(queries*sizeof(double))))
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for (n=QUERY_BENCH_MIN; n<=ACTIVE_MAX; n*=4)
+    {
+        double centre_lat = benchrand(&state, -60, 60), centre_lon = benchrand(&state, -180, 180);
+        double t, t_build, t_radius, t_nearest, t_lradius, t_lnearest;
+        double range = RENDER_RADIUS / (double) DEG_LENGTH;
+        volatile int sink=0;
+
+        /* Ships clustered like harbour traffic - half around a few ports and half scattered across the render radius */
+        for (i=0; i<n; i++)
+        {
+            double spread = i&1 ? range : range/20;
+            double lat = centre_lat + (i&1 ? 0 : ((i>>1) % 4) * range/3);
+            unsorted[i].ship.id = i;
+            unsorted[i].ship.kind = i % ship_kind_count;
+            unsorted[i].ship.lat = lat + benchrand(&state, -spread, spread);
+            unsorted[i].ship.lon = lonwrap(centre_lon + benchrand(&state, -spread, spread) / cos(centre_lat * (M_PI/180)));
+        }
+        for (i=0; i<queries; i++)
+        {
+            qlat[i] = centre_lat + benchrand(&state, -range, range);
+            qlon[i] = centre_lon + benchrand(&state, -range, range) / cos(centre_lat * (M_PI/180));
+        }
+
+        t=now();
+        for (j=0; j<16; j++)
+        {
+            entry_n = n;
+            gridbuild();
+        }
+        t_build=(now()-t) / 16;
+
+        t=now();
+        for (i=0; i<queries; i++)
+            sink+=queryradius(qlat[i], qlon[i], QUERY_BENCH_RADIUS, near, QUERY_BENCH_K, &count);
+        t_radius=now()-t;
+        t=now();
+        for (i=0; i<queries; i++)
+            sink+=querynearest(qlat[i], qlon[i], 0, near, QUERY_BENCH_K);
+        t_nearest=now()-t;
+        t=now();
+        for (i=0; i<queries; i++)
+            sink+=linearradius(qlat[i], qlon[i], QUERY_BENCH_RADIUS, &count);
+        t_lradius=now()-t;
+        t=now();
+        for (i=0; i<queries; i++)
+            sink+=linearnearest(qlat[i], qlon[i], check, QUERY_BENCH_K);
+        t_lnearest=now()-t;
+
+        /* Same answers? */
+        for (i=0; i<queries; i++)
+        {
+            int k = querynearest(qlat[i], qlon[i], 0, near, QUERY_BENCH_K);
+            if (k != linearnearest(qlat[i], qlon[i], check, QUERY_BENCH_K) ||
+                queryradius(qlat[i], qlon[i], QUERY_BENCH_RADIUS, NULL, 0, &count) != linearradius(qlat[i], qlon[i], QUERY_BENCH_RADIUS, &count))
+                mismatches++;
+            else
+                for (j=0; j<k; j++)
+                    if (near[j].distance != check[j].distance) { mismatches++; break; }
+        }
+
+        printf("Queries over %4d ships (%dx%d grid, built in %.1fus): %.0fm radius %.0fns (linear %.0fns), %d nearest %.0fns (linear %.0fns)\n",
+               n, grid_w, grid_h, t_build, QUERY_BENCH_RADIUS, t_radius*1000/queries, t_lradius*1000/queries,
+               QUERY_BENCH_K, t_nearest*1000/queries, t_lnearest*1000/queries);
+    }
+    printf("Queries that disagreed with linear scan: %d\n", mismatches);
+
+    free(qlat);
+    free(qlon);
+    return mismatches ? 1 : 0;
+}
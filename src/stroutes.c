@@ -0,0 +1,122 @@
+/*
+ * SeaTraffic
+ *
+ * (c) Jonathan Harris 2016
+ *
+ * Benchmark and accuracy check for the encoding of route paths. Not part of the plugin.
+ * Built by "make tools" with the same optimisation and floating point options as the plugin, so that the timings
+ * reflect the code that runs in flight. The encoding's internals are static, so routes.c is included rather than linked.
+ *
+ * Usage: stroutes [folder containing routes.txt]
+ */
+
+#include "routes.c"
+
+#include <time.h>
+
+#define ROUTES_BENCH_TIME 500000.0	/* Keep decoding all paths for at least this long [us] */
+
+
+/* Stand-ins for the parts of the plugin that routes.c uses */
+void XPLMDebugString(const char *inString)
+{
+    fputs(inString, stdout);
+}
+
+void mem_add(mem_kind_t kind, int allocs, int bytes)
+{
+}
+
+/* [us] of processor time */
+double perf_time(void)
+{
+    return (double) clock() * (1000000.0 / CLOCKS_PER_SEC);
+}
+
+
+/* Read and encode routes.txt like the plugin does, then time decoding the paths and check them against the paths as
+ * read. Returns non-zero if any node moved by more than PATH_QUANTUM. */
+int main(int argc, char **argv)
+{
+    char dir[PATH_MAX], err[256];
+    route_t **routes_read;
+    loc_t **paths, *check;
+    double start, elapsed, worst=0;
+    int i, j, n, runs, maxlen=0, bad=0;
+
+    if (argc > 2 || (argc == 2 && strlen(argv[1]) >= PATH_MAX-2))
+    {
+        fprintf(stderr, "Usage: %s [folder containing routes.txt]\n", argv[0]);
+        return 2;
+    }
+    strcpy(dir, argc > 1 ? argv[1] : ".");
+    if (dir[strlen(dir)-1] != '/' && dir[strlen(dir)-1] != '\\') { strcat(dir, "/"); }
+
+    if (!readroutes(dir, err))
+    {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    /* Keep the routes and their paths as read, since interning frees them */
+    n = route_n;
+    for (i=0; i<n; i++)
+        if (all_routes[i]->pathlen > maxlen) { maxlen = all_routes[i]->pathlen; }
+    if (!(routes_read = malloc(n * sizeof(route_t *))) || !(paths = malloc(n * sizeof(loc_t *))) || !(check = malloc(maxlen * sizeof(loc_t))))
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (i=0; i<n; i++)
+    {
+        routes_read[i] = all_routes[i];
+        if (!(paths[i] = malloc(all_routes[i]->pathlen * sizeof(loc_t))))
+        {
+            perror("malloc");
+            return 1;
+        }
+        memcpy(paths[i], all_routes[i]->path, all_routes[i]->pathlen * sizeof(loc_t));
+    }
+
+    start = perf_time();
+    if (!internroutes(err))
+    {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    printf("SeaTraffic: Interned %d routes in %.1fms\n", n, (perf_time() - start) / 1000);
+    routes_summary();
+
+    /* Speed */
+    runs = 0;
+    start = perf_time();
+    do
+    {
+        for (i=0; i<n; i++)
+            decodepath(routes_read[i], check);
+        runs++;
+    } while ((elapsed = perf_time() - start) < ROUTES_BENCH_TIME);
+    printf("SeaTraffic: Decoded all paths in %.2fms, %.1fns/node\n", elapsed / runs / 1000, intern_nodes ? elapsed * 1000 / runs / intern_nodes : 0.0);
+
+    /* Accuracy */
+    for (i=0; i<n; i++)
+    {
+        route_t *route = routes_read[i];
+        decodepath(route, check);
+        for (j=0; j<route->pathlen; j++)
+        {
+            double e = fabs((double) check[j].lat - (double) paths[i][j].lat);
+            double e_lon = fabs((double) check[j].lon - (double) paths[i][j].lon);
+            if (e_lon > e) { e = e_lon; }
+            if (e > worst) { worst = e; }
+            if (e > PATH_QUANTUM) { bad++; }
+        }
+        free(paths[i]);
+    }
+    printf("SeaTraffic: Worst error %.3fm (bound %.3fm), %d nodes out of bounds\n", worst * (double) DEG_LENGTH, PATH_QUANTUM * (double) DEG_LENGTH, bad);
+
+    free(routes_read);
+    free(paths);
+    free(check);
+    return bad ? 1 : 0;
+}